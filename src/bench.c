@@ -0,0 +1,647 @@
+// allocator benchmark, malloc/free through the public API only.
+//
+// every case runs in a process of its own so peak RSS and VMAs are its
+// own, -c runs each of them once under glibc and once with libmozart
+// preloaded. without -c the allocator is whatever the environment gives.
+//
+//   bench [-c] [-l lib] [-w churn,prodcons,realloc,lifetime,calloc]
+//         [-t 1,4,16,64] [-n ops per thread] [-s small|medium|large|mixed|MIN-MAX]
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "mozart.h"
+
+#define BENCH_THREADS	256
+#define BENCH_SLOTS	256			// churn working set per thread
+#define BENCH_LONG	4096		// long-lived blocks per thread
+#define BENCH_SHORT	8			// short-lived window
+#define BENCH_RING	1024		// producer -> consumer queue
+#define BENCH_SAMPLE	16			// time one op in 16
+#define BENCH_BUCKETS	256
+
+struct bench_ring {
+	void * volatile    slot[BENCH_RING];
+	unsigned long      head __attribute__((aligned(64)));
+	unsigned long      tail __attribute__((aligned(64)));
+	int                done;
+};
+
+struct bench_thread {
+	pthread_t          th;
+	unsigned           id;
+	uint64_t           seed;
+	unsigned long      ops;
+	struct bench_ring * ring;
+	uint64_t           hist[BENCH_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct bench_workload {
+	const char       * name;
+	void           * (*fn)(void *);
+	unsigned           pairs;		// threads come in producer/consumer pairs
+};
+
+static struct {
+	unsigned long      ops;
+	size_t             min, max;	// size range, both 0 for mixed
+	const char       * dist;
+	pthread_barrier_t  barrier;
+	unsigned           vmas;		// peak
+} bench = { .ops = 100000, .dist = "mixed" };
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, rand_r() is slow enough to show up in the small cases
+static inline uint64_t
+bench_rand(uint64_t * s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+// log-uniform in [min, max]: a power of two band, then uniform in it
+static size_t
+bench_size_in(uint64_t * s, size_t min, size_t max)
+{
+	unsigned lo = 63 - __builtin_clzl(min), hi = 63 - __builtin_clzl(max);
+	unsigned b = lo + bench_rand(s) % (hi - lo + 1);
+	size_t size = ((size_t)1 << b) + bench_rand(s) % ((size_t)1 << b);
+
+	return size < min ? min : size > max ? max : size;
+}
+
+// mixed: 80% up to 256 bytes, 18% up to 64 KiB, 2% up to 4 MiB
+static size_t
+bench_size(uint64_t * s)
+{
+	unsigned r;
+
+	if (bench.max)
+		return bench_size_in(s, bench.min, bench.max);
+	r = bench_rand(s) % 100;
+	if (r < 80)
+		return bench_size_in(s, 1, 256);
+	if (r < 98)
+		return bench_size_in(s, 257, 64 << 10);
+	return bench_size_in(s, (64 << 10) + 1, 4 << 20);
+}
+
+// 4 buckets per power of two, the same as MO_LATENCY
+static inline unsigned
+bench_bucket(uint64_t v)
+{
+	unsigned e;
+	if (v < 4)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return 4*(e - 1) + ((v >> (e - 2)) & 3);
+}
+
+static inline uint64_t
+bench_value(unsigned b)
+{
+	if (b < 4)
+		return b;
+	return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+#define bench_timed(t, op) do {											\
+	if (++(t)->ops % BENCH_SAMPLE) {									\
+		op;																\
+	} else {															\
+		uint64_t _t0 = bench_now();										\
+		op;																\
+		(t)->hist[bench_bucket(bench_now() - _t0)]++;					\
+	}																	\
+} while (0)
+
+// the first and the last byte carry a tag, checked before the free
+static void
+bench_fill(void * ptr, size_t size, unsigned char tag)
+{
+	if (!ptr) {
+		fprintf(stderr, "bench: out of memory, %zu bytes\n", size);
+		abort();
+	}
+	((unsigned char *)ptr)[0] = tag;
+	((unsigned char *)ptr)[size - 1] = tag;
+}
+
+static void
+bench_corrupt(const void * ptr, size_t size)
+{
+	fprintf(stderr, "bench: block %p of %zu bytes is corrupted\n", ptr, size);
+	abort();
+}
+
+static inline void
+bench_verify(const void * ptr, size_t size, unsigned char tag)
+{
+	const unsigned char * p = ptr;
+	if (p[0] != tag || p[size - 1] != tag)
+		bench_corrupt(ptr, size);
+}
+
+// lines of /proc/self/maps
+static unsigned
+bench_count_vmas(void)
+{
+	char buf[4096];
+	ssize_t i, n;
+	unsigned lines = 0;
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i=0; i<n; i++)
+			lines += buf[i] == '\n';
+	}
+	close(fd);
+	return lines;
+}
+
+// VMAs with every thread's working set live
+static void
+bench_working_set(void)
+{
+	if (pthread_barrier_wait(&bench.barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		unsigned v = bench_count_vmas();
+		if (v > bench.vmas)
+			bench.vmas = v;
+	}
+	pthread_barrier_wait(&bench.barrier);
+}
+
+// random malloc or free on a fixed set of slots
+static void *
+bench_churn(void * arg)
+{
+	struct bench_thread * t = arg;
+	void * ptr[BENCH_SLOTS] = { NULL };
+	size_t size[BENCH_SLOTS];
+	unsigned long i;
+
+	for (i=0; i<bench.ops; i++) {
+		unsigned k = bench_rand(&t->seed) % BENCH_SLOTS;
+		if (ptr[k]) {
+			bench_verify(ptr[k], size[k], k);
+			bench_timed(t, free(ptr[k]));
+			ptr[k] = NULL;
+		} else {
+			size[k] = bench_size(&t->seed);
+			bench_timed(t, ptr[k] = malloc(size[k]));
+			bench_fill(ptr[k], size[k], k);
+		}
+	}
+	bench_working_set();
+	for (i=0; i<BENCH_SLOTS; i++)
+		free(ptr[i]);
+	return NULL;
+}
+
+// even threads allocate, the odd one next to them frees: every free is a
+// remote one. the size rides in the block, the tag is its low byte.
+static void *
+bench_prodcons(void * arg)
+{
+	struct bench_thread * t = arg;
+	struct bench_ring * r = t->ring;
+	unsigned long i, head, tail;
+	size_t size;
+	void * p;
+
+	if (t->id % 2 == 0) {
+		for (i=0; i<bench.ops; i++) {
+			size = bench_size(&t->seed);
+			if (size <= sizeof(size_t))
+				size = sizeof(size_t) + 1;
+			bench_timed(t, p = malloc(size));
+			bench_fill(p, size, size);
+			memcpy(p, &size, sizeof(size));
+			head = r->head;
+			while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == BENCH_RING)
+				sched_yield();
+			r->slot[head % BENCH_RING] = p;
+			__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+	} else {
+		for (;;) {
+			tail = r->tail;
+			while (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) &&
+					tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+					goto out;
+				sched_yield();
+			}
+			p = r->slot[tail % BENCH_RING];
+			__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+			memcpy(&size, p, sizeof(size));
+			if (((unsigned char *)p)[size - 1] != (unsigned char)size)
+				bench_corrupt(p, size);
+			bench_timed(t, free(p));
+		}
+	}
+out:
+	return NULL;
+}
+
+// vector growth: realloc up by half again from 16 bytes to 16 times a
+// drawn size, then free. the bytes written before each step must survive.
+static void *
+bench_realloc(void * arg)
+{
+	struct bench_thread * t = arg;
+	unsigned long i = 0;
+	size_t size = 0, target = 16 * bench_size(&t->seed);
+	char * p = NULL;
+
+	while (i < bench.ops) {
+		if (size >= target) {
+			bench_timed(t, free(p));
+			p = NULL;
+			size = 0;
+			target = 16 * bench_size(&t->seed);
+			i++;
+			continue;
+		}
+		size_t n = size < 16 ? 16 : size + size / 2;
+		bench_timed(t, p = realloc(p, n));
+		if (!p) {
+			fprintf(stderr, "bench: out of memory, %zu bytes\n", n);
+			abort();
+		}
+		if (size && p[size - 1] != (char)size)
+			bench_corrupt(p, size);
+		size = n;
+		p[size - 1] = size;
+		i++;
+	}
+	bench_working_set();
+	free(p);
+	return NULL;
+}
+
+// a long-lived set replaced slowly, short-lived blocks freed a few
+// allocations later: one op in 16 touches the long-lived set
+static void *
+bench_lifetime(void * arg)
+{
+	struct bench_thread * t = arg;
+	void ** ptr = calloc(BENCH_LONG, sizeof(void *));
+	size_t * size = calloc(BENCH_LONG, sizeof(size_t));
+	void * win[BENCH_SHORT] = { NULL };
+	size_t wsize[BENCH_SHORT];
+	unsigned long i;
+	unsigned k;
+
+	for (i=0; i<bench.ops; i++) {
+		if (bench_rand(&t->seed) % 16 == 0) {
+			k = bench_rand(&t->seed) % BENCH_LONG;
+			if (ptr[k]) {
+				bench_verify(ptr[k], size[k], k);
+				bench_timed(t, free(ptr[k]));
+			}
+			size[k] = bench_size(&t->seed);
+			bench_timed(t, ptr[k] = malloc(size[k]));
+			bench_fill(ptr[k], size[k], k);
+		} else {
+			k = i % BENCH_SHORT;
+			if (win[k]) {
+				bench_verify(win[k], wsize[k], k);
+				bench_timed(t, free(win[k]));
+			}
+			wsize[k] = bench_size(&t->seed);
+			bench_timed(t, win[k] = malloc(wsize[k]));
+			bench_fill(win[k], wsize[k], k);
+		}
+	}
+	bench_working_set();
+	for (k=0; k<BENCH_SHORT; k++)
+		free(win[k]);
+	for (k=0; k<BENCH_LONG; k++)
+		free(ptr[k]);
+	free(ptr);
+	free(size);
+	return NULL;
+}
+
+// calloc, check the middle is zero, dirty it and free
+static void *
+bench_calloc(void * arg)
+{
+	struct bench_thread * t = arg;
+	unsigned long i;
+	size_t size;
+	char * p;
+
+	for (i=0; i<bench.ops; i+=2) {
+		size = bench_size(&t->seed);
+		bench_timed(t, p = calloc(1, size));
+		bench_fill(p, size, 0);
+		if (p[size / 2]) {
+			fprintf(stderr, "bench: calloc(%zu) is not zeroed\n", size);
+			abort();
+		}
+		memset(p, 0xa5, size < 4096 ? size : 4096);
+		p[size / 2] = 1;
+		bench_timed(t, free(p));
+	}
+	return NULL;
+}
+
+static const struct bench_workload bench_workloads[] = {
+	{ "churn",    bench_churn,    0 },
+	{ "prodcons", bench_prodcons, 1 },
+	{ "realloc",  bench_realloc,  0 },
+	{ "lifetime", bench_lifetime, 0 },
+	{ "calloc",   bench_calloc,   0 },
+};
+
+static const struct bench_workload *
+bench_workload(const char * name, size_t len)
+{
+	unsigned i;
+	for (i=0; i<sizeof(bench_workloads)/sizeof(bench_workloads[0]); i++) {
+		if (strlen(bench_workloads[i].name) == len &&
+			!strncmp(bench_workloads[i].name, name, len))
+			return &bench_workloads[i];
+	}
+	return NULL;
+}
+
+// syscalls made by libmozart so far, -1 when it is not loaded
+static long
+bench_syscalls(void)
+{
+	static void (*stats)(struct mo_stats *);
+	struct mo_stats st;
+
+	if (!stats)
+		stats = (void (*)(struct mo_stats *))dlsym(RTLD_DEFAULT, "mo_stats");
+	if (!stats)
+		return -1;
+	stats(&st);
+	return st.mmap + st.mprotect + st.munmap + st.madvise + st.mremap;
+}
+
+// one case, in this process: print its line
+static int
+bench_run(const struct bench_workload * w, unsigned n)
+{
+	static struct bench_thread th[BENCH_THREADS];
+	struct bench_ring * rings = NULL;
+	struct rusage ru;
+	uint64_t hist[BENCH_BUCKETS] = { 0 }, total = 0, seen;
+	double pct[3] = { 0.5, 0.99, 0.999 }, ns[3] = { 0 };
+	unsigned long ops = 0;
+	unsigned i, j, k;
+	int rc;
+
+	if (w->pairs && n % 2) {
+		printf("%-8s %-9s %4u  (needs an even thread count)\n", w->name, bench.dist, n);
+		return 0;
+	}
+	if (w->pairs) {
+		rings = calloc(n / 2, sizeof(struct bench_ring));
+		assert(rings);
+	}
+	rc = pthread_barrier_init(&bench.barrier, NULL, n);
+	assert(rc == 0);
+
+	long sys = bench_syscalls();
+	uint64_t t0 = bench_now();
+	for (i=0; i<n; i++) {
+		th[i].id = i;
+		th[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		th[i].ring = rings ? &rings[i / 2] : NULL;
+		rc = pthread_create(&th[i].th, NULL, w->fn, &th[i]);
+		assert(rc == 0);
+	}
+	// watch the VMAs grow until they are done
+	for (i=0; i<n; i++) {
+		while (pthread_tryjoin_np(th[i].th, NULL) == EBUSY) {
+			struct timespec ts = { 0, 10000000 };
+			unsigned v = bench_count_vmas();
+			if (v > bench.vmas)
+				bench.vmas = v;
+			nanosleep(&ts, NULL);
+		}
+	}
+	uint64_t t1 = bench_now();
+	if (sys >= 0)
+		sys = bench_syscalls() - sys;
+	pthread_barrier_destroy(&bench.barrier);
+	free(rings);
+
+	for (i=0; i<n; i++) {
+		ops += th[i].ops;
+		for (j=0; j<BENCH_BUCKETS; j++) {
+			hist[j] += th[i].hist[j];
+			total += th[i].hist[j];
+		}
+	}
+	for (k=0; k<3 && total; k++) {
+		for (j=0, seen=0; j<BENCH_BUCKETS; j++) {
+			seen += hist[j];
+			if (seen > pct[k] * total)
+				break;
+		}
+		// upper end of the bucket
+		ns[k] = bench_value(j + 1) - 1;
+	}
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%-8s %-9s %4u %-7s %11.0f %7.0f %7.0f %8.0f %9ld %6u ",
+		   w->name, bench.dist, n, sys >= 0 ? "mozart" : "glibc",
+		   ops / ((t1 - t0) / 1e9), ns[0], ns[1], ns[2], ru.ru_maxrss, bench.vmas);
+	if (sys >= 0)
+		printf("%7.4f\n", (double)sys / ops);
+	else
+		printf("%7s\n", "-");
+	fflush(stdout);
+	return 0;
+}
+
+// run a case in a fresh process, with libmozart preloaded, without it or
+// with whatever LD_PRELOAD says (lib NULL, preload -1)
+static int
+bench_spawn(char * self, char ** args, const char * lib, int preload)
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid < 0) {
+		perror("bench: fork");
+		return -1;
+	}
+	if (pid == 0) {
+		if (preload == 1)
+			setenv("LD_PRELOAD", lib, 1);
+		else if (preload == 0)
+			unsetenv("LD_PRELOAD");
+		execv(self, args);
+		perror("bench: exec");
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "bench: %s %s threads failed\n", args[2], args[4]);
+		return -1;
+	}
+	return 0;
+}
+
+static size_t
+bench_parse_size(const char * s, char ** end)
+{
+	size_t v = strtoul(s, end, 0);
+	switch (**end) {
+	case 'k': case 'K': v <<= 10; (*end)++; break;
+	case 'm': case 'M': v <<= 20; (*end)++; break;
+	case 'g': case 'G': v <<= 30; (*end)++; break;
+	}
+	return v;
+}
+
+static int
+bench_parse_dist(const char * s)
+{
+	char * end;
+
+	bench.dist = s;
+	if (!strcmp(s, "mixed")) {
+		bench.min = bench.max = 0;
+	} else if (!strcmp(s, "small")) {
+		bench.min = 1;
+		bench.max = 256;
+	} else if (!strcmp(s, "medium")) {
+		bench.min = 257;
+		bench.max = 64 << 10;
+	} else if (!strcmp(s, "large")) {
+		bench.min = (64 << 10) + 1;
+		bench.max = 4 << 20;
+	} else {
+		bench.min = bench_parse_size(s, &end);
+		if (*end++ != '-')
+			return -1;
+		bench.max = bench_parse_size(end, &end);
+		if (*end || !bench.min || bench.max < bench.min)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+bench_usage(void)
+{
+	fprintf(stderr,
+		"usage: bench [-c] [-l lib] [-w workloads] [-t threads] [-n ops] [-s sizes]\n"
+		"  -c  compare, every case under glibc and with lib preloaded\n"
+		"  -l  libmozart to preload with -c, ./libmozart.so by default\n"
+		"  -w  churn,prodcons,realloc,lifetime,calloc (all of them)\n"
+		"  -t  thread counts, 1,4,16,64 by default\n"
+		"  -n  ops per thread, 100000 by default\n"
+		"  -s  small, medium, large, mixed or MIN-MAX, k and M suffixes (mixed)\n");
+	exit(2);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * workloads = "churn,prodcons,realloc,lifetime,calloc";
+	const char * threads = "1,4,16,64";
+	const char * lib = "./libmozart.so";
+	const char * one = NULL;
+	char self[PATH_MAX], path[PATH_MAX], nops[32], nthr[16];
+	int compare = 0, failed = 0, c;
+
+	while ((c = getopt(argc, argv, "cl:w:t:n:s:x:")) != -1) {
+		switch (c) {
+		case 'c': compare = 1; break;
+		case 'l': lib = optarg; break;
+		case 'w': workloads = optarg; break;
+		case 't': threads = optarg; break;
+		case 'n': bench.ops = strtoul(optarg, NULL, 0); break;
+		case 's': if (bench_parse_dist(optarg)) bench_usage(); break;
+		case 'x': one = optarg; break;			// a single case, from bench_spawn
+		default:  bench_usage();
+		}
+	}
+	if (optind != argc || !bench.ops)
+		bench_usage();
+
+	if (one) {
+		const struct bench_workload * w = bench_workload(one, strlen(one));
+		unsigned n = strtoul(threads, NULL, 0);
+		if (!w || !n || n > BENCH_THREADS)
+			bench_usage();
+		return bench_run(w, n);
+	}
+
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("bench: /proc/self/exe");
+		return 1;
+	}
+	self[len] = 0;
+	if (compare && !realpath(lib, path)) {
+		fprintf(stderr, "bench: %s: %s\n", lib, strerror(errno));
+		return 1;
+	}
+	snprintf(nops, sizeof(nops), "%lu", bench.ops);
+
+	printf("%lu ops per thread, latency of one op in %u\n", bench.ops, BENCH_SAMPLE);
+	printf("%-8s %-9s %4s %-7s %11s %7s %7s %8s %9s %6s %7s\n", "workload", "sizes",
+		   "thr", "malloc", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "rss KiB",
+		   "vmas", "sys/op");
+	for (const char * w = workloads; *w; ) {
+		size_t len = strcspn(w, ",");
+		const struct bench_workload * wl = bench_workload(w, len);
+		if (!wl) {
+			fprintf(stderr, "bench: no workload %.*s\n", (int)len, w);
+			bench_usage();
+		}
+		for (const char * t = threads; *t; ) {
+			unsigned n = strtoul(t, NULL, 0);
+			if (!n || n > BENCH_THREADS)
+				bench_usage();
+			snprintf(nthr, sizeof(nthr), "%u", n);
+			char * args[] = { self, "-x", (char *)wl->name, "-t", nthr, "-n", nops,
+							  "-s", (char *)bench.dist, NULL };
+			if (compare) {
+				failed |= bench_spawn(self, args, NULL, 0);
+				failed |= bench_spawn(self, args, path, 1);
+			} else {
+				failed |= bench_spawn(self, args, NULL, -1);
+			}
+			t += strcspn(t, ",");
+			t += *t == ',';
+		}
+		w += len;
+		w += *w == ',';
+	}
+	return failed ? 1 : 0;
+}
@@ -1,5 +1,11 @@
-gcc -fPIC  -g pool.c malloc.c -lpthread -shared -o libmozart.so
-gcc -fPIC  -g pool.c malloc.c -lpthread -DMALLOC_TEST -o malloc_test
+gcc -fPIC  -g -fno-omit-frame-pointer pool.c canary.c depot.c prof.c malloc.c -lpthread -ldl -shared -o libmozart.so
+gcc -fPIC  -g -fno-omit-frame-pointer pool.c canary.c depot.c prof.c malloc.c -lpthread -ldl -DMALLOC_TEST -o malloc_test
 gcc -fPIC  -g pool.c -DPOOL_TEST -o pool_test
+gcc -fPIC  -O2 -g pool.c -DPOOL_BENCH -o pool_bench
+gcc -fPIC  -O2 -g canary.c -DCANARY_TEST -o canary_test
+gcc -fPIC  -O2 -g -fno-omit-frame-pointer depot.c -lpthread -DDEPOT_TEST -o depot_test
+gcc -fPIC  -O2 -g -fno-omit-frame-pointer prof.c depot.c -lpthread -DPROF_TEST -o prof_test
 
 
+gcc -O2 -g bench.c -lpthread -ldl -o bench
+gcc -O2 -g replay.c -lpthread -ldl -o replay
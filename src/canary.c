@@ -0,0 +1,203 @@
+#include <string.h>
+#include "canary.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define CANARY_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CANARY_NEON
+#include <arm_neon.h>
+#endif
+
+// a word at a time, then bytes
+static size_t
+canary_check_scalar(const void * ptr, size_t len, uint8_t c)
+{
+	const unsigned char * p = ptr;
+	uint64_t v = 0x0101010101010101ULL * c, w;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, p + i, 8);
+		if (w != v)
+			break;
+	}
+	for (; i < len; i++) {
+		if (p[i] != c)
+			break;
+	}
+	return i;
+}
+
+#ifdef CANARY_X86
+static size_t
+canary_check_sse2(const void * ptr, size_t len, uint8_t c)
+{
+	const unsigned char * p = ptr;
+	__m128i v = _mm_set1_epi8(c);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, v)) != 0xffff)
+			break;
+	}
+	return i + canary_check_scalar(p + i, len - i, c);
+}
+
+__attribute__((target("avx2"))) static size_t
+canary_check_avx2(const void * ptr, size_t len, uint8_t c)
+{
+	const unsigned char * p = ptr;
+	__m256i v = _mm256_set1_epi8(c);
+	size_t i = 0;
+
+	// 2 vectors per round, the loop is bound by loads
+	for (; i + 64 <= len; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i e = _mm256_and_si256(_mm256_cmpeq_epi8(a, v), _mm256_cmpeq_epi8(b, v));
+		if ((unsigned)_mm256_movemask_epi8(e) != 0xffffffffU)
+			break;
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, v)) != 0xffffffffU)
+			break;
+	}
+	return i + canary_check_scalar(p + i, len - i, c);
+}
+
+static void
+canary_stream(unsigned char * p, size_t len, uint8_t c)
+{
+	size_t head = -(uintptr_t)p & 15;
+	__m128i v = _mm_set1_epi8(c);
+
+	memset(p, c, head);
+	p += head;
+	len -= head;
+	for (; len >= 64; p += 64, len -= 64) {
+		_mm_stream_si128((__m128i *)p, v);
+		_mm_stream_si128((__m128i *)(p + 16), v);
+		_mm_stream_si128((__m128i *)(p + 32), v);
+		_mm_stream_si128((__m128i *)(p + 48), v);
+	}
+	_mm_sfence();
+	memset(p, c, len);
+}
+
+static size_t (*canary_check_fn)(const void *, size_t, uint8_t) = canary_check_sse2;
+
+#elif defined(CANARY_NEON)
+static size_t
+canary_check_neon(const void * ptr, size_t len, uint8_t c)
+{
+	const unsigned char * p = ptr;
+	uint8x16_t v = vdupq_n_u8(c);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		uint8x16_t e = vandq_u8(vceqq_u8(vld1q_u8(p + i), v),
+								vceqq_u8(vld1q_u8(p + i + 16), v));
+		if (vminvq_u8(e) != 0xff)
+			break;
+	}
+	return i + canary_check_scalar(p + i, len - i, c);
+}
+
+// stnp, a pair of q registers per store, not kept in the cache
+static void
+canary_stream(unsigned char * p, size_t len, uint8_t c)
+{
+	size_t head = -(uintptr_t)p & 31;
+	uint8x16_t v = vdupq_n_u8(c);
+
+	memset(p, c, head);
+	p += head;
+	len -= head;
+	for (; len >= 32; p += 32, len -= 32)
+		__asm__ __volatile__("stnp %q1, %q1, [%0]" : : "r"(p), "w"(v) : "memory");
+	__asm__ __volatile__("dmb ishst" : : : "memory");
+	memset(p, c, len);
+}
+
+static size_t (*canary_check_fn)(const void *, size_t, uint8_t) = canary_check_neon;
+
+#else
+static void
+canary_stream(unsigned char * p, size_t len, uint8_t c)
+{
+	memset(p, c, len);
+}
+
+static size_t (*canary_check_fn)(const void *, size_t, uint8_t) = canary_check_scalar;
+#endif
+
+void
+canary_init(void)
+{
+#ifdef CANARY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		canary_check_fn = canary_check_avx2;
+#endif
+}
+
+void
+canary_fill(void * ptr, size_t len, uint8_t c)
+{
+	if (len < CANARY_STREAM_MIN)
+		memset(ptr, c, len);
+	else
+		canary_stream(ptr, len, c);
+}
+
+size_t
+canary_check(const void * ptr, size_t len, uint8_t c)
+{
+	// too short to pay for the indirect call
+	if (len < 16)
+		return canary_check_scalar(ptr, len, c);
+	return canary_check_fn(ptr, len, c);
+}
+
+#ifdef CANARY_TEST
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main()
+{
+	size_t len, i;
+	size_t max = 2*CANARY_STREAM_MIN + 100;
+	unsigned char * buf = malloc(max + 64);
+
+	canary_init();
+	for (len=0; len<300; len++) {
+		for (i=0; i<=len; i++) {
+			canary_fill(buf + 3, len, 0xcb);
+			if (i < len)
+				buf[3 + i] = 0;
+			assert(canary_check(buf + 3, len, 0xcb) == i);
+		}
+	}
+	canary_fill(buf + 5, max, 0xcb);
+	assert(canary_check(buf + 5, max, 0xcb) == max);
+	buf[5 + max - 1] = 0;
+	assert(canary_check(buf + 5, max, 0xcb) == max - 1);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<1000; i++)
+		canary_check(buf + 5, max, 0xcb);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("check: %.2f bytes/ns\n", 1000.0 * max / ns);
+
+	free(buf);
+	printf("canary test ok\n");
+	return 0;
+}
+#endif
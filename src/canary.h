@@ -0,0 +1,19 @@
+#ifndef __CANARY_H
+#define __CANARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// pick the kernels for this cpu, the portable ones are used until then.
+void   canary_init (void);
+
+// fill len bytes with c. fills of CANARY_STREAM_MIN bytes or more use
+// non-temporal stores, they do not pull the range into the cache.
+void   canary_fill (void * ptr, size_t len, uint8_t c);
+
+// offset of the first byte that is not c, len if all of them are.
+size_t canary_check(const void * ptr, size_t len, uint8_t c);
+
+#define CANARY_STREAM_MIN	(256*1024)
+
+#endif
@@ -7,4 +7,10 @@ USEFILE=/dev/null
 
 NAME=mozart
 
+# MO_STACKS walks frame pointers
+CCFLAGS+=-fno-omit-frame-pointer
+
+# the benchmark and the trace replay are programs of their own, see build.sh
+EXCLUDE_OBJS=bench.o replay.o
+
 include $(MKFILES_ROOT)/qtargets.mk
@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "depot.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	0
+#endif
+
+// open addressing table of ids, a slot is claimed by a CAS. the frames
+// live in a store that only grows, an id is the offset of its stack in
+// 8 byte words, plus one. both are reserved up front, pages are only
+// touched as they fill.
+#define DEPOT_TABLE_BITS	20
+#define DEPOT_STORE		(256UL << 20)
+
+struct depot_stack {
+	uint32_t  hash;
+	uint32_t  n;
+	uintptr_t pc[];
+};
+
+static struct {
+	uint32_t * table;
+	char     * store;
+	size_t     used;
+	unsigned   mask;
+} depot;
+
+#define DEPOT_TLS	__thread __attribute__((tls_model("initial-exec")))
+
+static DEPOT_TLS uintptr_t depot_stack_hi;
+static DEPOT_TLS int       depot_stack_busy;
+
+int
+depot_init(void)
+{
+	size_t table = sizeof(uint32_t) << DEPOT_TABLE_BITS;
+
+	depot.table = mmap(NULL, table, PROT_READ|PROT_WRITE,
+					   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (depot.table == MAP_FAILED)
+		return -1;
+	depot.store = mmap(NULL, DEPOT_STORE, PROT_READ|PROT_WRITE,
+					   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (depot.store == MAP_FAILED) {
+		munmap(depot.table, table);
+		return -1;
+	}
+	depot.mask = (1U << DEPOT_TABLE_BITS) - 1;
+	return 0;
+}
+
+// top of this thread's stack, 0 while it is being looked up: glibc may
+// allocate in there and come back. 0 where it is not known, no walk then.
+static uintptr_t
+depot_stack_top(void)
+{
+#ifdef __linux__
+	pthread_attr_t attr;
+	void * addr;
+	size_t size;
+
+	if (depot_stack_hi || depot_stack_busy)
+		return depot_stack_hi;
+	depot_stack_busy = 1;
+	if (!pthread_getattr_np(pthread_self(), &attr)) {
+		if (!pthread_attr_getstack(&attr, &addr, &size))
+			depot_stack_hi = (uintptr_t)addr + size;
+		pthread_attr_destroy(&attr);
+	}
+	depot_stack_busy = 0;
+#endif
+	return depot_stack_hi;
+}
+
+// a frame record is the saved frame pointer, then the return address,
+// on x86_64 and aarch64 alike
+__attribute__((noinline)) unsigned
+depot_capture(uintptr_t * pc, unsigned max)
+{
+	uintptr_t * fp = __builtin_frame_address(0), * next;
+	uintptr_t hi = depot_stack_top();
+	unsigned n = 0;
+
+	while (n < max) {
+		if ((uintptr_t)fp & (sizeof(uintptr_t) - 1) || (uintptr_t)(fp + 2) > hi)
+			break;
+		if (!fp[1])
+			break;
+		pc[n++] = fp[1];
+		next = (uintptr_t *)fp[0];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return n;
+}
+
+static uint32_t
+depot_hash(const uintptr_t * pc, unsigned n)
+{
+	uint64_t h = n;
+	unsigned i;
+
+	for (i=0; i<n; i++)
+		h = (h ^ pc[i]) * 0x9e3779b97f4a7c15ULL;
+	return h ^ h >> 32;
+}
+
+static struct depot_stack *
+depot_stack(uint32_t id)
+{
+	size_t off = (size_t)(id - 1) * sizeof(uintptr_t);
+
+	if (!id || off >= __atomic_load_n(&depot.used, __ATOMIC_ACQUIRE))
+		return NULL;
+	return (struct depot_stack *)(depot.store + off);
+}
+
+uint32_t
+depot_put(const uintptr_t * pc, unsigned n)
+{
+	uint32_t h, id, free_id = 0;
+	unsigned i, probes;
+	struct depot_stack * s;
+
+	if (!depot.table || !n)
+		return 0;
+	h = depot_hash(pc, n);
+	for (i = h & depot.mask, probes = 0; probes <= depot.mask; i = (i + 1) & depot.mask, probes++) {
+		id = __atomic_load_n(&depot.table[i], __ATOMIC_ACQUIRE);
+		if (!id) {
+			// a stack written for a slot lost to another thread is kept
+			// for the next free slot
+			if (!free_id) {
+				size_t size = sizeof(*s) + n * sizeof(uintptr_t);
+				size_t off = __atomic_fetch_add(&depot.used, size, __ATOMIC_RELAXED);
+				if (off + size > DEPOT_STORE)
+					return 0;
+				s = (struct depot_stack *)(depot.store + off);
+				s->hash = h;
+				s->n = n;
+				memcpy(s->pc, pc, n * sizeof(uintptr_t));
+				free_id = off / sizeof(uintptr_t) + 1;
+			}
+			if (__atomic_compare_exchange_n(&depot.table[i], &id, free_id, 0,
+											__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+				return free_id;
+		}
+		s = (struct depot_stack *)(depot.store + (size_t)(id - 1) * sizeof(uintptr_t));
+		if (s->hash == h && s->n == n && !memcmp(s->pc, pc, n * sizeof(uintptr_t)))
+			return id;
+	}
+	return 0;
+}
+
+const uintptr_t *
+depot_get(uint32_t id, unsigned * n)
+{
+	struct depot_stack * s = depot_stack(id);
+
+	if (!s)
+		return NULL;
+	*n = s->n;
+	return s->pc;
+}
+
+// text out without stdio, it is not signal safe
+struct depot_out {
+	int    fd;
+	int    err;
+	size_t len;
+	char   buf[4096];
+};
+
+static void
+depot_flush(struct depot_out * o)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < o->len && !o->err) {
+		n = write(o->fd, o->buf + done, o->len - done);
+		if (n > 0)
+			done += n;
+		else if (n < 0 && errno != EINTR)
+			o->err = 1;
+	}
+	o->len = 0;
+}
+
+static void
+depot_puts(struct depot_out * o, const char * s, size_t len)
+{
+	while (len) {
+		size_t n = sizeof(o->buf) - o->len;
+		if (n > len)
+			n = len;
+		memcpy(o->buf + o->len, s, n);
+		o->len += n;
+		s += n;
+		len -= n;
+		if (o->len == sizeof(o->buf))
+			depot_flush(o);
+	}
+}
+
+static void
+depot_hex(struct depot_out * o, uint64_t v, char sep)
+{
+	char s[20];
+	int i = sizeof(s);
+
+	s[--i] = sep;
+	do {
+		s[--i] = "0123456789abcdef"[v & 15];
+		v >>= 4;
+	} while (v);
+	s[--i] = 'x';
+	s[--i] = '0';
+	depot_puts(o, s + i, sizeof(s) - i);
+}
+
+// # mozart stack depot
+// maps
+// <contents of /proc/self/maps>
+// stacks
+// <id> <pc> <pc> ...
+int
+depot_dump(int fd)
+{
+	struct depot_out o = { .fd = fd };
+	char buf[4096];
+	unsigned i, k;
+	ssize_t n;
+	int maps;
+
+	depot_puts(&o, "# mozart stack depot\nmaps\n", 26);
+	maps = open("/proc/self/maps", O_RDONLY);
+	if (maps >= 0) {
+		while ((n = read(maps, buf, sizeof(buf))) > 0)
+			depot_puts(&o, buf, n);
+		close(maps);
+	}
+	depot_puts(&o, "stacks\n", 7);
+	for (i=0; depot.table && i<=depot.mask; i++) {
+		uint32_t id = __atomic_load_n(&depot.table[i], __ATOMIC_ACQUIRE);
+		struct depot_stack * s = depot_stack(id);
+		if (!s)
+			continue;
+		depot_hex(&o, id, ' ');
+		for (k=0; k<s->n; k++)
+			depot_hex(&o, s->pc[k], k + 1 < s->n ? ' ' : '\n');
+	}
+	depot_flush(&o);
+	return o.err ? -1 : 0;
+}
+
+#ifdef DEPOT_TEST
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define DEPOT_THREADS	4
+
+static __attribute__((noinline)) uint32_t
+depot_test_leaf(unsigned depth)
+{
+	uintptr_t pc[DEPOT_FRAMES];
+	uint32_t id;
+	if (depth)
+		id = depot_test_leaf(depth - 1);
+	else
+		id = depot_put(pc, depot_capture(pc, DEPOT_FRAMES));
+	__asm__ __volatile__("" : : : "memory");	// no tail call
+	return id;
+}
+
+static void *
+depot_test_thread(void * arg)
+{
+	uint32_t * ids = arg;
+	unsigned i;
+	for (i=0; i<16; i++)
+		ids[i] = depot_test_leaf(i);
+	return NULL;
+}
+
+int main()
+{
+	uint32_t ids[DEPOT_THREADS][16];
+	pthread_t th[DEPOT_THREADS];
+	const uintptr_t * pc;
+	struct timespec t0, t1;
+	unsigned i, n, m;
+
+	assert(depot_init() == 0);
+	uint32_t id[3];
+	// the same call site twice, then one frame deeper
+#pragma GCC unroll 1
+	for (i=0; i<3; i++)
+		id[i] = depot_test_leaf(3 + i / 2);
+	assert(id[0] && id[0] == id[1] && id[2] && id[0] != id[2]);
+	assert((pc = depot_get(id[0], &n)) && n >= 4);
+	assert(depot_get(id[2], &m) && m == n + 1);
+	assert(!depot_get(0, &n));
+
+	// racing threads agree on the ids
+	for (i=0; i<DEPOT_THREADS; i++)
+		pthread_create(&th[i], NULL, depot_test_thread, ids[i]);
+	for (i=0; i<DEPOT_THREADS; i++)
+		pthread_join(th[i], NULL);
+	for (i=1; i<DEPOT_THREADS; i++)
+		assert(!memcmp(ids[0], ids[i], sizeof(ids[0])));
+	for (i=1; i<16; i++)
+		assert(ids[0][i] != ids[0][i - 1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<1000000; i++)
+		depot_test_leaf(i % 16);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("capture and put: %.0f ns\n",
+		   ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1000000);
+
+	int fd = open("/dev/null", O_WRONLY);
+	assert(depot_dump(fd) == 0);
+	close(fd);
+	printf("depot test ok\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef __DEPOT_H
+#define __DEPOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// stack depot: backtraces interned once, known by a 32 bit id.
+// 0 is no stack. stacks are never removed.
+#define DEPOT_FRAMES	64
+
+// reserve the table and the frame store, -1 if that fails.
+int        depot_init   (void);
+
+// frame pointer walk from the caller of depot_capture, up to max
+// return addresses. stops at the first frame outside the thread stack,
+// code built without frame pointers ends the walk early.
+unsigned   depot_capture(uintptr_t * pc, unsigned max);
+
+// id of the stack, the same frames always get the same id.
+// lock free, 0 when the depot is full.
+uint32_t   depot_put    (const uintptr_t * pc, unsigned n);
+
+// frames of an id, NULL if there is no such stack.
+const uintptr_t * depot_get(uint32_t id, unsigned * n);
+
+// write every stack and a copy of /proc/self/maps to fd, as text, for
+// stacks.sh to symbolize. async signal safe.
+int        depot_dump   (int fd);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,12 +10,56 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <limits.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "bsd-tree.h"
 #include "pool.h"
+#include "mozart.h"
+#include "canary.h"
+#include "trace.h"
+#include "depot.h"
+#include "prof.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	0
+#endif
+
+// guard regions, linux 6.13. older kernels fail them with EINVAL.
+#if defined(__linux__) && !defined(MADV_GUARD_INSTALL)
+#define MADV_GUARD_INSTALL	102
+#define MADV_GUARD_REMOVE	103
+#endif
+
+enum {
+	MO_NODE_FREE = 0,	// in span cache, pages are PROT_NONE
+	MO_NODE_LIVE,		// owned by user
+	MO_NODE_SLAB,		// slots of a slab, see mo_slab
+};
+
+struct mo_site;
 
 struct mo_rbnode {
-	RB_ENTRY(mo_rbnode)  ptr_entry;
 	RB_ENTRY(mo_rbnode)  page_entry;
+	struct {
+		struct mo_rbnode * next;
+		struct mo_rbnode * prev;
+	} class_entry, age_entry;
+	int                  state;
+	int                  released;	// cached span was madvised, pages are zero
+	int                  sampled;	// in the heap profile, MO_PROF
+	uint32_t             alloc_stack;	// stack depot ids, MO_STACKS
+	uint32_t             free_stack;
+	struct mo_arena    * arena;		// slot of an arena, or mmap'ed
+	unsigned long        seq;		// free order in its shard
 	struct {
 		uintptr_t		ptr;
 		unsigned		num;
@@ -22,197 +67,3179 @@ struct mo_rbnode {
 	struct {
 		uintptr_t       ptr;
 		size_t          size;
-		const char *	info;
+		struct mo_site *info;	// callsite, NULL if the site table is full
 	} user;
 };
 
-static int
-mo_rbnode_ptr_cmp(struct mo_rbnode * p1, struct mo_rbnode * p2)
-{
-	if (p1->user.ptr < p2->user.ptr) return -1;
-	if (p1->user.ptr > p2->user.ptr) return  1;
-	return 0;
-}
-
+// spans of the same size are told apart by free order, oldest first.
+// RB_INSERT drops duplicated keys.
 static int
 mo_rbnode_page_cmp(struct mo_rbnode * p1, struct mo_rbnode * p2)
 {
 	if (p1->pages.num < p2->pages.num) return -1;
 	if (p1->pages.num > p2->pages.num) return  1;
+	if (p1->seq < p2->seq) return -1;
+	if (p1->seq > p2->seq) return  1;
 	return 0;
 }
 
-RB_HEAD(mo_rbnode_ptr_tree, mo_rbnode);
-RB_PROTOTYPE(mo_rbnode_ptr_tree, mo_rbnode, ptr_entry, mo_rbnode_ptr_cmp);
-RB_GENERATE (mo_rbnode_ptr_tree, mo_rbnode, ptr_entry, mo_rbnode_ptr_cmp);
-
 RB_HEAD(mo_rbnode_page_tree, mo_rbnode);
 RB_PROTOTYPE(mo_rbnode_page_tree, mo_rbnode, page_entry, mo_rbnode_page_cmp);
 RB_GENERATE (mo_rbnode_page_tree, mo_rbnode, page_entry, mo_rbnode_page_cmp);
 
+// page_tree is split in shards, each with its own lock. threads are dealt
+// to the shards in turn, a thread caches what it frees in its own shard
+// and looks there first. MO_TREE_SHARDS sets the count.
+#define MO_SHARDS_MAX	64
+
+struct mo_span_list {
+	struct mo_rbnode * head;
+	struct mo_rbnode * tail;
+};
+
+// span cache: freed spans, pages kept PROT_NONE.
+// spans up to MO_SPAN_CLASSES pages (guard page included) are kept in a
+// FIFO list per page count, larger ones in page_tree for best fit.
+// every shard has its own class lists.
+//
+// the cache is a quarantine as well. every shard keeps its spans in free
+// order (age list) and owns an equal part of the budgets, shared by the
+// shards in use so far:
+//  MO_QUARANTINE_BYTES: resident bytes, oldest spans over it are madvised
+//  MO_QUARANTINE_VMAS : cached spans, oldest spans over it are unmapped
+// madvised spans stay PROT_NONE in the cache and still trap.
+// they always form the head of the age list, 'fresh' is the first one
+// that is not madvised.
+#define MO_SPAN_CLASSES	64
+
+struct mo_page_shard {
+	pthread_mutex_t             mutex;
+	struct mo_rbnode_page_tree  tree;
+	struct mo_span_list         classes[MO_SPAN_CLASSES + 1];
+	struct mo_span_list         age;
+	struct mo_rbnode          * fresh;
+	unsigned long               seq;
+	size_t                      bytes;
+	size_t                      spans;
+	unsigned long               splits;
+	unsigned long               evicts;
+} __attribute__((aligned(64)));
+
+// slot arenas for spans up to MO_ARENA_PAGES data pages.
+// an arena reserves MO_ARENA_SLOTS slots of one size up front, PROT_NONE:
+//   [header | guard | k data pages | guard | k data pages | guard ...]
+// every guard page sits between two slots and guards both of them.
+// a slot span is its data pages plus the guard after it, like a mmap'ed
+// span, so the span cache handles both. slot state is a cbt bitmap.
+// where the kernel has guard regions the arena is a single read/write
+// mapping: one madvise puts guard markers on every slot when it is
+// made, a slot is opened by removing its markers and shut by putting
+// them back, which drops its pages. live slots then share one VMA.
+// elsewhere the slots are PROT_NONE and mprotect'ed, one VMA each.
+#define MO_ARENA_PAGES_MAX	16
+#define MO_ARENA_SLOTS		8192
+
+struct mo_arena {
+	struct mo_arena * next;
+	uintptr_t         base;     // first slot
+	size_t            size;     // mapping size
+	unsigned          pages;    // data pages per slot
+	int               markers;  // guard regions, not mprotect
+	size_t            used;
+	struct cbt        cbt;
+};
+
+struct mo_arena_class {
+	pthread_mutex_t   mutex;
+	struct mo_arena * head;
+	struct mo_arena * hint;
+} __attribute__((aligned(64)));
+
+// slabs for allocations up to MO_SLAB_MAX bytes, 0 turns them off.
+// objects of a 16 bytes class share a slab, each slot is the object and
+// a redzone of at least MO_REDZONE bytes, all filled with MO_CANARY:
+//   [header | guard | obj rz | obj rz | ... | guard]
+// the redzone is checked on free and by mo_check(), a linear overflow
+// is caught byte exact. with MO_POISON free slots are canary filled too,
+// a write after free is caught when the slot is handed out again.
+// the slot pages have one rbnode in the page map, embedded in the header.
+#define MO_SLAB_CLASSES	64
+#define MO_SLAB_PAGES	16
+#define MO_REDZONE		16
+#define MO_CANARY		0xcb
+
+struct mo_slab {
+	struct mo_rbnode  node;		// state MO_NODE_SLAB
+	struct mo_slab  * next;
+	uintptr_t         base;		// first slot
+	size_t            size;		// mapping size
+	unsigned          stride;	// slot size
+	size_t            slots;
+	size_t            used;
+	uint16_t        * user;		// requested size per slot, 0 if free
+	uint32_t        * stacks;	// alloc and free stack per slot, MO_STACKS
+	uint64_t        * sampled;	// slots in the heap profile, MO_PROF
+	struct cbt        cbt;
+};
+
+struct mo_slab_class {
+	pthread_mutex_t   mutex;
+	struct mo_slab  * head;
+	struct mo_slab  * hint;
+} __attribute__((aligned(64)));
+
+// guarding rules, MO_GUARD_MIN / MO_GUARD_MAX bound the size,
+// MO_GUARD_ALLOW / MO_GUARD_DENY list callers, comma separated:
+//   0xaddr       a return address
+//   0xlo-0xhi    a range of return addresses
+//   name         code of every loaded object whose path contains name,
+//                the executable included
+// lists are compiled at init into sorted address ranges.
+#define MO_RULES_MAX	64
+
+struct mo_range {
+	uintptr_t lo, hi;	// [lo, hi)
+};
+
+struct mo_ranges {
+	unsigned        count;
+	struct mo_range range[MO_RULES_MAX];
+};
+
+struct mo_rules {
+	int              enabled;
+	size_t           min;
+	size_t           max;
+	struct mo_ranges allow;
+	struct mo_ranges deny;
+};
+
+// callsites of guarded allocations, keyed by return address.
+// MO_ADAPT_CPU (percent of one cpu) and MO_ADAPT_MEM (bytes of guarded
+// pages) set a budget, while over it the costliest site with at least
+// MO_ADAPT_MIN guarded allocations and no fault is demoted to the next
+// allocator, one per MO_ADAPT_PERIOD guarded allocations.
+#define MO_SITES		4096
+#define MO_ADAPT_PERIOD	4096
+#define MO_ADAPT_BATCH	64
+
+struct mo_site {
+	uintptr_t     caller;
+	int           demoted;
+	int           faults;		// double or wild frees seen
+	unsigned long allocs;
+	unsigned long bytes;
+	unsigned long ticks;		// spent in mo_malloc and mo_free
+	unsigned long ticks_mark;	// ticks at the last evaluation
+	size_t        live;			// guarded pages held, in bytes
+} __attribute__((aligned(64)));
+
+struct mo_adapt {
+	int             enabled;
+	int             busy;		// an evaluation is running
+	unsigned        cpu;
+	size_t          mem;
+	unsigned long   min;
+	unsigned long   count;		// guarded allocations
+	unsigned long   ticks;		// of all sites
+	size_t          live;		// of all sites
+	unsigned long   ticks_mark;
+	uint64_t        now_mark;
+	unsigned long   demoted;
+	struct mo_site *sites;
+};
+
+// a thread's counts not yet added to mo_adapt and the site, folded every
+// MO_ADAPT_BATCH calls, when the site changes and when the thread exits.
+struct mo_adapt_pend {
+	struct mo_site * site;
+	unsigned long    allocs;	// of site
+	unsigned long    bytes;
+	unsigned long    ticks;
+	long             live;
+	unsigned long    all_allocs;
+	unsigned long    all_ticks;
+	long             all_live;
+	unsigned         calls;
+};
+
+// the allocator behind us, gets whatever is not guarded.
+struct mo_next {
+	void * (*malloc) (size_t);
+	void   (*free)   (void *);
+	void * (*calloc) (size_t, size_t);
+	void * (*realloc)(void *, size_t);
+	int    (*posix_memalign)(void **, size_t, size_t);
+	size_t (*malloc_usable_size)(void *);
+};
+
+// statistics: every thread counts in its own cache line, threads are
+// registered in mo_ctx.stat and folded into retired on exit.
+// mo_stats() sums them up. live bytes are kept per thread as a delta,
+// flushed to mo_ctx.stat.live once it passes MO_STAT_BATCH either way,
+// the peak is exact up to that much per thread.
+#define MO_TLS	__thread __attribute__((tls_model("initial-exec")))
+#define MO_STAT_BATCH	(1024*1024)
+
+struct mo_counters {
+	unsigned long mallocs;
+	unsigned long frees;
+	long          bytes;
+	unsigned long mmap;
+	unsigned long mprotect;
+	unsigned long munmap;
+	unsigned long madvise;
+	unsigned long mremap;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+// latency histograms, MO_LATENCY=1. per thread, in ticks, 4 buckets per
+// power of 2. lock waits are only timed when a trylock fails, an
+// uncontended lock counts as 0. tree is the time spent holding a shard
+// lock, syscall the time in mmap and friends.
+enum {
+	MO_LAT_MALLOC = 0,
+	MO_LAT_FREE,
+	MO_LAT_REALLOC,
+	MO_LAT_POOL_LOCK,
+	MO_LAT_SHARD_LOCK,
+	MO_LAT_CLASS_LOCK,	// arena and slab classes
+	MO_LAT_SYSCALL,
+	MO_LAT_TREE,
+	MO_LAT_MAX,
+};
+
+#define MO_LAT_BUCKETS	256
+
+struct mo_hist {
+	uint64_t count[MO_LAT_MAX][MO_LAT_BUCKETS];
+	uint64_t max[MO_LAT_MAX];
+};
+
+struct mo_tstat {
+	struct mo_counters c;
+	struct mo_hist   * hist;		// mmap'ed on first use
+	void             * altstack;	// ours, MO_SEGV
+	struct mo_adapt_pend adapt;
+	int                state;		// 0 new, 1 registered, -1 exited
+	struct mo_tstat  * next;
+	struct mo_tstat  * prev;
+} __attribute__((aligned(64)));
+
+// allocation trace, MO_TRACE=<file>. each thread appends to a ring of
+// its own, the writer thread flushes them every MO_TRACE_PERIOD. a thread
+// that finds its ring full hands it to the writer and goes on in a new
+// one, nothing is dropped and a traced call never waits for the file.
+#define MO_TRACE_RING	4096
+#define MO_TRACE_PERIOD	10000000	// ns
+#define MO_TRACE_SPARE	4			// drained rings kept for reuse
+
+struct mo_trace_ring {
+	uint64_t               head;		// written by the owner
+	uint64_t               tail __attribute__((aligned(64)));	// by the flusher
+	int                    dead;		// owner done with it, unmap once drained
+	struct mo_trace_ring * next;
+	struct mo_trace_event  ev[MO_TRACE_RING];
+};
+
+// live heap report, MO_HEAP_REPORT=<groups>: live blocks summed by
+// allocation stack with MO_STACKS, by caller without. slab objects have
+// no caller, without a stack they are summed by size class.
+#define MO_LIVE_SLOTS	(1 << 16)
+#define MO_LIVE_TOP		256
+#define MO_LIVE_STACK	(1ULL << 62)	// key tags, a caller is below
+#define MO_LIVE_SLAB	(2ULL << 62)
+#define MO_LIVE_UNKNOWN	(3ULL << 62)
+
+struct mo_live {
+	uint64_t key;		// 0 for a free slot
+	size_t   blocks;
+	size_t   bytes;
+};
+
 struct mo_ctx {
 	int             reuse_memory;
+	int             stats;
+	int             poison;		// canary fill freed memory
+	int             latency;	// keep histograms
+	size_t          align;		// of malloc, power of 2 up to a page
+	unsigned        stack_depth;	// frames kept per stack, 0 keeps none
+	const char    * stack_dump;	// file the depot goes to at exit
+	struct mo_ranges self;		// our code, left out of the stacks
+	long            sample_rate;	// guard 1 in sample_rate, <= 1 guards all
+	struct mo_rules rules;
+	struct mo_adapt adapt;
+	struct mo_next  next;
+	unsigned        arena_pages;
 	pthread_mutex_t pool_mutex;
-	struct pool   * pool;
+	struct pool_chain pool;
+
+	unsigned             nshards;
+	unsigned             shard_next;		// threads dealt so far
+	size_t               quarantine_bytes;
+	size_t               quarantine_spans;
+	struct mo_page_shard page_tree[MO_SHARDS_MAX];
+
+	struct mo_arena_class arenas[MO_ARENA_PAGES_MAX + 1];
+
+	size_t               slab_max;
+	struct mo_slab_class slabs[MO_SLAB_CLASSES + 1];
+
+	struct {
+		pthread_mutex_t    mutex;
+		pthread_key_t      key;
+		int                key_ready;
+		struct mo_tstat  * threads;		// registered, alive
+		struct mo_counters retired;		// of exited threads
+		long               live;		// flushed deltas
+		long               peak;
+		struct mo_hist     hist;		// of exited threads
+		uint64_t           ticks0;		// ticks and time at init,
+		struct timespec    time0;		// to convert ticks to ns
+	} stat;
+
+	struct {
+		int                    enabled;
+		int                    fd;
+		uint64_t               seq;
+		uint64_t               time0;		// CLOCK_MONOTONIC at init, ns
+		pthread_mutex_t        mutex;		// the rings list
+		pthread_mutex_t        out_mutex;	// the file, one flusher at a time
+		sem_t                  wake;		// a ring is full
+		pthread_key_t          key;
+		struct mo_trace_ring * rings;
+		struct mo_trace_ring * spare;		// drained, chained on next
+		unsigned               nspare;
+		pthread_t              writer;
+		int                    running;
+		int                    stop;
+	} trace;
+
+	struct {
+		size_t                 rate;	// bytes per sample, 0 for no profile
+		const char           * dir;
+		unsigned               period;	// seconds between profiles
+		unsigned long          seq;		// profiles written
+		int                    child;	// forked, no profile at exit
+	} prof;
 
 	struct {
-		pthread_mutex_t             mutex;
-		struct mo_rbnode_ptr_tree   tree;
-	} ptr_tree;
+		int                    enabled;
+		struct sigaction       old;		// handler before ours
+	} segv;
+
 	struct {
-		pthread_mutex_t             mutex;
-		struct mo_rbnode_page_tree tree;
-	} page_tree;
+		unsigned               top;		// groups reported, 0 for no report
+		pthread_mutex_t        mutex;	// one report at a time
+		struct mo_live       * table;	// MO_LIVE_SLOTS, zero between reports
+		sem_t                  wake;	// posted on SIGUSR2
+	} live;
 };
 
 static struct mo_ctx mo_ctx = {
 	.reuse_memory = 1,
-	.pool       = NULL,
+	.align      = 16,
+	.rules      = { .max = SIZE_MAX },
+	.adapt      = { .min = 1000 },
 	.pool_mutex = PTHREAD_MUTEX_INITIALIZER,
-	.ptr_tree = {
+	.arena_pages = 8,
+	.nshards    = 16,
+	.arenas     = {
+		[0 ... MO_ARENA_PAGES_MAX] = {
+			.mutex  = PTHREAD_MUTEX_INITIALIZER,
+		},
+	},
+	.slabs      = {
+		[0 ... MO_SLAB_CLASSES] = {
+			.mutex  = PTHREAD_MUTEX_INITIALIZER,
+		},
+	},
+	.stat       = {
+		.mutex  = PTHREAD_MUTEX_INITIALIZER,
+	},
+	.trace      = {
+		.fd     = -1,
+		.seq    = 1,
 		.mutex  = PTHREAD_MUTEX_INITIALIZER,
-		.tree   = RB_INITIALIZER(NULL),
+		.out_mutex = PTHREAD_MUTEX_INITIALIZER,
 	},
-	.page_tree = {
+	.live       = {
 		.mutex  = PTHREAD_MUTEX_INITIALIZER,
-		.tree   = RB_INITIALIZER(NULL),
+	},
+	.page_tree  = {
+		[0 ... MO_SHARDS_MAX-1] = {
+			.mutex  = PTHREAD_MUTEX_INITIALIZER,
+			.tree   = RB_INITIALIZER(NULL),
+		},
 	},
 };
 
+static MO_TLS unsigned mo_shard;		// page_tree index + 1
+
+static MO_TLS struct mo_tstat mo_tstat;
+
+// MO_SEGV reports on a stack of its own, a fault from an exhausted stack
+// has none left. a thread that has one already keeps it.
+#define MO_SEGV_STACK	(64 << 10)
+
+static void *
+mo_segv_altstack(void)
+{
+	stack_t ss;
+
+	if (sigaltstack(NULL, &ss) || !(ss.ss_flags & SS_DISABLE))
+		return NULL;
+	ss.ss_sp = mmap(NULL, MO_SEGV_STACK, PROT_READ|PROT_WRITE,
+					MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ss.ss_sp == MAP_FAILED)
+		return NULL;
+	ss.ss_size = MO_SEGV_STACK;
+	ss.ss_flags = 0;
+	if (sigaltstack(&ss, NULL)) {
+		munmap(ss.ss_sp, MO_SEGV_STACK);
+		return NULL;
+	}
+	return ss.ss_sp;
+}
+
+static void
+mo_site_flush(struct mo_adapt_pend * p)
+{
+	struct mo_site * site = p->site;
+
+	if (site) {
+		__atomic_add_fetch(&site->allocs, p->allocs, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->bytes, p->bytes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->ticks, p->ticks, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->live, p->live, __ATOMIC_RELAXED);
+	}
+	p->site   = NULL;
+	p->allocs = p->bytes = p->ticks = 0;
+	p->live   = 0;
+}
+
+// everything pending, 1 when the allocations crossed an evaluation
+static int
+mo_adapt_flush(struct mo_adapt_pend * p)
+{
+	struct mo_adapt * a = &mo_ctx.adapt;
+	unsigned long count;
+
+	mo_site_flush(p);
+	__atomic_add_fetch(&a->ticks, p->all_ticks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->live, p->all_live, __ATOMIC_RELAXED);
+	count = __atomic_fetch_add(&a->count, p->all_allocs, __ATOMIC_RELAXED);
+	count = count % MO_ADAPT_PERIOD + p->all_allocs;
+	p->all_allocs = p->all_ticks = 0;
+	p->all_live   = 0;
+	p->calls      = 0;
+	return count >= MO_ADAPT_PERIOD;
+}
+
+static void
+mo_tstat_fold(void * arg)
+{
+	int rc;
+	struct mo_tstat * t = arg;
+	struct mo_counters * r = &mo_ctx.stat.retired;
+
+	rc = pthread_mutex_lock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+	r->mallocs  += t->c.mallocs;
+	r->frees    += t->c.frees;
+	r->mmap     += t->c.mmap;
+	r->mprotect += t->c.mprotect;
+	r->munmap   += t->c.munmap;
+	r->madvise  += t->c.madvise;
+	r->mremap   += t->c.mremap;
+	r->hits     += t->c.hits;
+	r->misses   += t->c.misses;
+	mo_ctx.stat.live += t->c.bytes;
+	mo_adapt_flush(&t->adapt);
+	if (t->hist) {
+		unsigned i, j;
+		for (i=0; i<MO_LAT_MAX; i++) {
+			for (j=0; j<MO_LAT_BUCKETS; j++)
+				mo_ctx.stat.hist.count[i][j] += t->hist->count[i][j];
+			if (mo_ctx.stat.hist.max[i] < t->hist->max[i])
+				mo_ctx.stat.hist.max[i] = t->hist->max[i];
+		}
+		munmap(t->hist, sizeof(*t->hist));
+		t->hist = NULL;
+	}
+	if (t->altstack) {
+		stack_t ss = { .ss_flags = SS_DISABLE };
+		if (!sigaltstack(&ss, NULL))
+			munmap(t->altstack, MO_SEGV_STACK);
+		t->altstack = NULL;
+	}
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		mo_ctx.stat.threads = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	// counts after this point are lost, the tls goes away with the thread
+	t->state = -1;
+	rc = pthread_mutex_unlock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+}
+
+static void
+mo_tstat_register(struct mo_tstat * t)
+{
+	int rc;
+
+	if (t->state || !__atomic_load_n(&mo_ctx.stat.key_ready, __ATOMIC_ACQUIRE))
+		return;
+	rc = pthread_setspecific(mo_ctx.stat.key, t);
+	assert(rc == 0);
+	if (mo_ctx.segv.enabled && !t->altstack)
+		t->altstack = mo_segv_altstack();
+	rc = pthread_mutex_lock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+	t->prev = NULL;
+	t->next = mo_ctx.stat.threads;
+	if (t->next)
+		t->next->prev = t;
+	mo_ctx.stat.threads = t;
+	t->state = 1;
+	rc = pthread_mutex_unlock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+}
+
+// only the owner writes, readers load relaxed.
+#define mo_count(field, n)												\
+	{																	\
+		struct mo_tstat * t_ = &mo_tstat;								\
+		if (__builtin_expect(t_->state != 1, 0))						\
+			mo_tstat_register(t_);									\
+		__atomic_store_n(&t_->c.field, t_->c.field + (n), __ATOMIC_RELAXED); \
+	}
+
+static void
+mo_count_flush(long bytes)
+{
+	long live = __atomic_add_fetch(&mo_ctx.stat.live, bytes, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&mo_ctx.stat.peak, __ATOMIC_RELAXED);
+	while (live > peak &&
+		   !__atomic_compare_exchange_n(&mo_ctx.stat.peak, &peak, live, 0,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void
+mo_count_bytes(long bytes)
+{
+	mo_count(bytes, bytes);
+	long b = mo_tstat.c.bytes;
+	if (b >= MO_STAT_BATCH || b <= -MO_STAT_BATCH) {
+		__atomic_store_n(&mo_tstat.c.bytes, 0, __ATOMIC_RELAXED);
+		mo_count_flush(b);
+	}
+}
+
+static inline uint64_t
+mo_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t t;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// a malloc or free is only timed for MO_ADAPT or MO_LATENCY, 0 otherwise
+static inline uint64_t
+mo_op_ticks(void)
+{
+	return __builtin_expect(mo_ctx.adapt.enabled || mo_ctx.latency, 0) ? mo_ticks() : 0;
+}
+
+static inline unsigned
+mo_lat_bucket(uint64_t v)
+{
+	unsigned e;
+	if (v < 4)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return 4*(e - 1) + ((v >> (e - 2)) & 3);
+}
+
+// smallest value of a bucket
+static inline uint64_t
+mo_lat_value(unsigned b)
+{
+	if (b < 4)
+		return b;
+	return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+static void
+mo_lat_record(int what, uint64_t ticks)
+{
+	struct mo_tstat * t = &mo_tstat;
+	struct mo_hist * h = t->hist;
+
+	if (!h) {
+		mo_tstat_register(t);
+		if (t->state != 1)
+			return;
+		h = mmap(NULL, sizeof(*h), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (h == MAP_FAILED)
+			return;
+		__atomic_store_n(&t->hist, h, __ATOMIC_RELEASE);
+	}
+	uint64_t * c = &h->count[what][mo_lat_bucket(ticks)];
+	__atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+	if (ticks > h->max[what])
+		__atomic_store_n(&h->max[what], ticks, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+mo_lat_start(void)
+{
+	return __builtin_expect(mo_ctx.latency, 0) ? mo_ticks() : 0;
+}
+
+static inline void
+mo_lat_end(int what, uint64_t t0)
+{
+	if (__builtin_expect(t0 != 0, 0))
+		mo_lat_record(what, mo_ticks() - t0);
+}
+
+static inline int
+mo_mutex_lock(pthread_mutex_t * m, int what)
+{
+	int rc;
+	if (__builtin_expect(!mo_ctx.latency, 1))
+		return pthread_mutex_lock(m);
+	if (!pthread_mutex_trylock(m)) {
+		mo_lat_record(what, 0);
+		return 0;
+	}
+	uint64_t t0 = mo_ticks();
+	rc = pthread_mutex_lock(m);
+	mo_lat_record(what, mo_ticks() - t0);
+	return rc;
+}
+
+// count the mm syscalls, MO_STATS reports them.
+#define mo_syscall(name, ...)											\
+	({																	\
+		mo_count(name, 1);												\
+		uint64_t t0_ = mo_lat_start();									\
+		__typeof__(name(__VA_ARGS__)) r_ = name(__VA_ARGS__);			\
+		mo_lat_end(MO_LAT_SYSCALL, t0_);								\
+		r_;																\
+	})
+
 static size_t sys_pagesize = 4096;
+static unsigned sys_pageshift = 12;
 static pthread_once_t mo_once = PTHREAD_ONCE_INIT;
 
+// size with optional k/m/g suffix
+static size_t
+mo_env_size(const char * name, size_t def)
+{
+	char * end, * env = getenv(name);
+	if (!env)
+		return def;
+	size_t v = strtoull(env, &end, 0);
+	switch (*end) {
+	case 'g': case 'G': v <<= 10; // fall through
+	case 'm': case 'M': v <<= 10; // fall through
+	case 'k': case 'K': v <<= 10;
+	}
+	return v;
+}
+
+// page map: page number -> rbnode of the span covering that page,
+// guard page included. 3 levels radix of MO_MAP_BITS each.
+// tables are mmap'ed on demand and never freed, entries are
+// updated with atomic stores, so lookups take no lock.
+#define MO_MAP_BITS		12
+#define MO_MAP_SIZE		(1U << MO_MAP_BITS)
+#define MO_MAP_MASK		(MO_MAP_SIZE - 1)
+
+struct mo_map_table {
+	void * slot[MO_MAP_SIZE];
+};
+
+static struct mo_map_table mo_map;
+
+static struct mo_map_table *
+mo_map_table(void ** slot)
+{
+	struct mo_map_table * t = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (t)
+		return t;
+	t = mo_syscall(mmap, NULL, sizeof(*t), PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED) {
+		assert(0 && "unable to alloc page map");
+		return NULL;
+	}
+	void * expected = NULL;
+	if (!__atomic_compare_exchange_n(slot, &expected, t, 0,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		// lost the race
+		mo_syscall(munmap, t, sizeof(*t));
+		t = expected;
+	}
+	return t;
+}
+
+static void
+mo_map_set(uintptr_t ptr, size_t pages, struct mo_rbnode * node)
+{
+	uintptr_t pn = ptr >> sys_pageshift;
+	assert(!((pn + pages - 1) >> (3 * MO_MAP_BITS)));
+
+	while (pages) {
+		struct mo_map_table * mid, * leaf;
+		mid  = mo_map_table(&mo_map.slot[pn >> (2 * MO_MAP_BITS)]);
+		leaf = mid ? mo_map_table(&mid->slot[(pn >> MO_MAP_BITS) & MO_MAP_MASK]) : NULL;
+		if (!leaf)
+			return;
+		do {
+			__atomic_store_n(&leaf->slot[pn & MO_MAP_MASK], node, __ATOMIC_RELEASE);
+			pn ++;
+			pages --;
+		} while (pages && (pn & MO_MAP_MASK));
+	}
+}
+
+// the allocation whose span contains addr, 3 dependent loads.
+static struct mo_rbnode *
+mo_rbnode_lookup(const void * addr)
+{
+	uintptr_t pn = (uintptr_t)addr >> sys_pageshift;
+	struct mo_map_table * t;
+
+	if (pn >> (3 * MO_MAP_BITS))
+		return NULL;
+	t = __atomic_load_n(&mo_map.slot[pn >> (2 * MO_MAP_BITS)], __ATOMIC_ACQUIRE);
+	if (!t)
+		return NULL;
+	t = __atomic_load_n(&t->slot[(pn >> MO_MAP_BITS) & MO_MAP_MASK], __ATOMIC_ACQUIRE);
+	if (!t)
+		return NULL;
+	return __atomic_load_n(&t->slot[pn & MO_MAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+// per-thread magazine of rbnodes.
+// refilled from / drained to mo_ctx.pool in batches of MO_TCACHE_BATCH,
+// so pool_mutex is only taken once every MO_TCACHE_BATCH alloc/free.
+#define MO_TCACHE_SIZE	64
+#define MO_TCACHE_BATCH	32
+
+struct mo_tcache {
+	unsigned            count;
+	int                 registered;
+	struct mo_rbnode  * nodes[MO_TCACHE_SIZE];
+};
+
+static MO_TLS struct mo_tcache mo_tcache;
+static pthread_key_t mo_tcache_key;
+
+static void
+mo_tcache_flush(void * arg)
+{
+	int rc, r;
+	struct mo_tcache * tc = arg;
+
+	rc = mo_mutex_lock(&mo_ctx.pool_mutex, MO_LAT_POOL_LOCK);
+	assert(rc == 0);
+	while (tc->count) {
+		r = pool_chain_free(&mo_ctx.pool, tc->nodes[--tc->count]);
+		assert(r == 0);
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+	assert(rc == 0);
+	// thread may still malloc in other tls destructors,
+	// registers again in that case.
+	tc->registered = 0;
+}
+
+// dlsym may allocate while mo_init resolves the next allocator,
+// those few allocations are served from a static buffer.
+static struct {
+	int      resolving;
+	size_t   used;
+	char     buf[64 * 1024] __attribute__((aligned(16)));
+} mo_boot;
+
+#define mo_boot_owns(ptr)												\
+	((char *)(ptr) >= mo_boot.buf && (char *)(ptr) < mo_boot.buf + sizeof(mo_boot.buf))
+
+static void *
+mo_boot_alloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	size_t off = __atomic_fetch_add(&mo_boot.used, size, __ATOMIC_RELAXED);
+	if (off + size > sizeof(mo_boot.buf)) {
+		assert(0 && "boot buffer exhausted");
+		return NULL;
+	}
+	return mo_boot.buf + off;
+}
+
+static void *
+mo_boot_memalign(size_t align, size_t size)
+{
+	char * ptr = mo_boot_alloc(size + align);
+	if (!ptr)
+		return NULL;
+	return (void *)(((uintptr_t)ptr + align - 1) & ~(align - 1));
+}
+
+static void
+mo_next_init(void)
+{
+	mo_boot.resolving = 1;
+	mo_ctx.next.malloc  = dlsym(RTLD_NEXT, "malloc");
+	mo_ctx.next.free    = dlsym(RTLD_NEXT, "free");
+	mo_ctx.next.calloc  = dlsym(RTLD_NEXT, "calloc");
+	mo_ctx.next.realloc = dlsym(RTLD_NEXT, "realloc");
+	mo_ctx.next.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	mo_ctx.next.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+	mo_boot.resolving = 0;
+	assert(mo_ctx.next.malloc && mo_ctx.next.free &&
+		   mo_ctx.next.calloc && mo_ctx.next.realloc &&
+		   mo_ctx.next.posix_memalign && mo_ctx.next.malloc_usable_size);
+}
+
+static MO_TLS struct mo_trace_ring * mo_trace_ring;
+static MO_TLS uint32_t mo_trace_tid;
+
+// a failed write stops the trace, the rings are still drained
+static void
+mo_trace_write(const void * buf, size_t len)
+{
+	const char * p = buf;
+	ssize_t n;
+
+	while (len && mo_ctx.trace.fd >= 0) {
+		n = write(mo_ctx.trace.fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "mo: trace write failed. errno=%d, tracing stopped\n", errno);
+			__atomic_store_n(&mo_ctx.trace.enabled, 0, __ATOMIC_RELAXED);
+			mo_ctx.trace.fd = -1;
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+// dead first: the head read after it is the last one
+static inline int
+mo_trace_drained(struct mo_trace_ring * r)
+{
+	return __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+		r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+// trace.out_mutex held. the rings are written out without trace.mutex,
+// it is taken to find them and to unlink the drained dead ones.
+// only the flusher unlinks, new rings go in at the head.
+static void
+mo_trace_flush(void)
+{
+	struct mo_trace_ring ** pr, * r;
+	int rc, dead = 0;
+
+	rc = pthread_mutex_lock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	r = mo_ctx.trace.rings;
+	rc = pthread_mutex_unlock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+
+	for (; r; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = r->tail;
+
+		while (tail < head) {
+			uint64_t i = tail % MO_TRACE_RING, n = head - tail;
+			if (n > MO_TRACE_RING - i)
+				n = MO_TRACE_RING - i;
+			mo_trace_write(&r->ev[i], n * sizeof(r->ev[0]));
+			tail += n;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dead |= mo_trace_drained(r);
+	}
+	if (!dead)
+		return;
+
+	rc = pthread_mutex_lock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	for (pr = &mo_ctx.trace.rings; (r = *pr); ) {
+		if (mo_trace_drained(r)) {
+			*pr = r->next;
+			if (mo_ctx.trace.nspare < MO_TRACE_SPARE) {
+				r->next = mo_ctx.trace.spare;
+				mo_ctx.trace.spare = r;
+				mo_ctx.trace.nspare ++;
+			} else {
+				munmap(r, sizeof(*r));
+			}
+		} else {
+			pr = &r->next;
+		}
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+}
+
+static void
+mo_trace_lock_flush(void)
+{
+	int rc = pthread_mutex_lock(&mo_ctx.trace.out_mutex);
+	assert(rc == 0);
+	mo_trace_flush();
+	rc = pthread_mutex_unlock(&mo_ctx.trace.out_mutex);
+	assert(rc == 0);
+}
+
+// thread exit, the flusher unmaps the ring once it is written out
+static void
+mo_trace_retire(void * arg)
+{
+	struct mo_trace_ring * r = arg;
+
+	if (mo_trace_ring == r)
+		mo_trace_ring = NULL;
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct mo_trace_ring *
+mo_trace_ring_new(void)
+{
+	int rc;
+	struct mo_trace_ring * r;
+
+	rc = pthread_mutex_lock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	if ((r = mo_ctx.trace.spare)) {
+		mo_ctx.trace.spare = r->next;
+		mo_ctx.trace.nspare --;
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	if (r) {
+		r->head = r->tail = 0;
+		r->dead = 0;
+	} else {
+		r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (r == MAP_FAILED)
+			return NULL;
+	}
+	mo_trace_tid = syscall(SYS_gettid);
+	rc = pthread_mutex_lock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	r->next = mo_ctx.trace.rings;
+	mo_ctx.trace.rings = r;
+	rc = pthread_mutex_unlock(&mo_ctx.trace.mutex);
+	assert(rc == 0);
+	// setspecific may allocate, the ring has to be in place first
+	mo_trace_ring = r;
+	rc = pthread_setspecific(mo_ctx.trace.key, r);
+	assert(rc == 0);
+	return r;
+}
+
+static void
+mo_trace_record(int op, void * ptr, uintptr_t arg, size_t size,
+				const void * caller, uint64_t seq0)
+{
+	struct mo_trace_ring * r = mo_trace_ring;
+	struct mo_trace_event * e;
+	struct timespec ts;
+	uint64_t seq;
+
+	if (!r && !(r = mo_trace_ring_new()))
+		return;
+	if (op == MO_TRACE_FREE && seq0)
+		seq = seq0;
+	else
+		seq = __atomic_fetch_add(&mo_ctx.trace.seq, 1, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == MO_TRACE_RING) {
+		struct mo_trace_ring * full = r;
+		// the writer drains and unmaps the full one. without a writer,
+		// or without a new ring, it is written out here.
+		if (mo_ctx.trace.running && (r = mo_trace_ring_new())) {
+			__atomic_store_n(&full->dead, 1, __ATOMIC_RELEASE);
+			sem_post(&mo_ctx.trace.wake);
+		} else {
+			r = full;
+			mo_trace_lock_flush();
+		}
+	}
+
+	e = &r->ev[r->head % MO_TRACE_RING];
+	e->seq    = seq;
+	e->seq0   = seq0 ? seq0 : seq;
+	e->time   = ts.tv_sec * 1000000000ULL + ts.tv_nsec - mo_ctx.trace.time0;
+	e->ptr    = (uintptr_t)ptr;
+	e->arg    = arg;
+	e->size   = size;
+	e->caller = (uintptr_t)caller;
+	e->tid    = mo_trace_tid;
+	e->op     = op;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// seq of a free, or of the release half of a realloc. 0 if not tracing.
+static inline uint64_t
+mo_trace_begin(void)
+{
+	if (__builtin_expect(!mo_ctx.trace.enabled, 1))
+		return 0;
+	return __atomic_fetch_add(&mo_ctx.trace.seq, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+mo_trace(int op, void * ptr, uintptr_t arg, size_t size, const void * caller, uint64_t seq0)
+{
+	if (__builtin_expect(mo_ctx.trace.enabled, 0))
+		mo_trace_record(op, ptr, arg, size, caller, seq0);
+}
+
+static void
+mo_trace_open(const char * path)
+{
+	struct mo_trace_header h = {
+		.magic      = MO_TRACE_MAGIC,
+		.version    = MO_TRACE_VERSION,
+		.event_size = sizeof(struct mo_trace_event),
+		.pid        = getpid(),
+	};
+	struct timespec ts;
+	int rc;
+
+	mo_ctx.trace.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (mo_ctx.trace.fd < 0) {
+		fprintf(stderr, "mo: MO_TRACE: cannot open %s. errno=%d\n", path, errno);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h.time0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	mo_trace_write(&h, sizeof(h));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mo_ctx.trace.time0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rc = pthread_key_create(&mo_ctx.trace.key, mo_trace_retire);
+	assert(rc == 0);
+	rc = sem_init(&mo_ctx.trace.wake, 0, 0);
+	assert(rc == 0);
+	__atomic_store_n(&mo_ctx.trace.enabled, mo_ctx.trace.fd >= 0, __ATOMIC_RELEASE);
+}
+
+// every MO_TRACE_PERIOD, or at once when a ring fills up
+static void *
+mo_trace_writer(void * arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	while (!__atomic_load_n(&mo_ctx.trace.stop, __ATOMIC_ACQUIRE)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += MO_TRACE_PERIOD;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec ++;
+			ts.tv_nsec -= 1000000000;
+		}
+		sem_timedwait(&mo_ctx.trace.wake, &ts);
+		mo_trace_lock_flush();
+	}
+	return NULL;
+}
+
+// the child has no writer and shares the file, it is not traced
+static void
+mo_trace_atfork_child(void)
+{
+	mo_ctx.trace.enabled = 0;
+	mo_ctx.trace.running = 0;
+	mo_ctx.trace.fd = -1;
+}
+
+// events after the last flush, from later destructors, are not recorded
+__attribute__((destructor)) static void
+mo_trace_stop(void)
+{
+	if (!mo_ctx.trace.enabled)
+		return;
+	if (mo_ctx.trace.running) {
+		__atomic_store_n(&mo_ctx.trace.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(mo_ctx.trace.writer, NULL);
+		mo_ctx.trace.running = 0;
+	}
+	__atomic_store_n(&mo_ctx.trace.enabled, 0, __ATOMIC_RELAXED);
+	mo_trace_lock_flush();
+}
+
+static void
+mo_ranges_add(struct mo_ranges * r, uintptr_t lo, uintptr_t hi)
+{
+	unsigned i;
+	if (r->count == MO_RULES_MAX) {
+		fprintf(stderr, "mo: too many guard rules, ignored\n");
+		return;
+	}
+	for (i=r->count; i>0 && r->range[i-1].lo > lo; i--)
+		r->range[i] = r->range[i-1];
+	r->range[i].lo = lo;
+	r->range[i].hi = hi;
+	r->count ++;
+}
+
+static int
+mo_ranges_match(const struct mo_ranges * r, uintptr_t addr)
+{
+	unsigned lo = 0, hi = r->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (r->range[mid].lo <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo && addr < r->range[lo-1].hi;
+}
+
+struct mo_dso_match {
+	const char       * name;
+	struct mo_ranges * ranges;
+};
+
+// executable segments of the objects matching a name
+static int
+mo_dso_ranges(struct dl_phdr_info * info, size_t size, void * arg)
+{
+	int i;
+	struct mo_dso_match * m = arg;
+	const char * path = info->dlpi_name[0] ? info->dlpi_name : program_invocation_name;
+
+	(void)size;
+	if (!strstr(path, m->name))
+		return 0;
+	for (i=0; i<info->dlpi_phnum; i++) {
+		const ElfW(Phdr) * ph = &info->dlpi_phdr[i];
+		if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+			uintptr_t lo = info->dlpi_addr + ph->p_vaddr;
+			mo_ranges_add(m->ranges, lo, lo + ph->p_memsz);
+		}
+	}
+	return 0;
+}
+
+static void
+mo_rules_parse(const char * env, struct mo_ranges * ranges)
+{
+	char name[256];
+	const char * p = env, * end;
+
+	while (*p) {
+		end = strchr(p, ',');
+		if (!end)
+			end = p + strlen(p);
+		if (end - p > 0 && end - p < (long)sizeof(name)) {
+			memcpy(name, p, end - p);
+			name[end - p] = 0;
+			if (!strncmp(name, "0x", 2)) {
+				char * e;
+				uintptr_t lo = strtoull(name, &e, 16), hi = lo + 1;
+				if (*e == '-')
+					hi = strtoull(e + 1, NULL, 16);
+				mo_ranges_add(ranges, lo, hi);
+			} else {
+				struct mo_dso_match m = { name, ranges };
+				dl_iterate_phdr(mo_dso_ranges, &m);
+			}
+		}
+		p = *end ? end + 1 : end;
+	}
+}
+
+static void
+mo_rules_init(struct mo_rules * rules)
+{
+	char * env;
+
+	if ((env = getenv("MO_GUARD_MIN")))
+		rules->min = mo_env_size("MO_GUARD_MIN", 0);
+	if ((env = getenv("MO_GUARD_MAX")))
+		rules->max = mo_env_size("MO_GUARD_MAX", SIZE_MAX);
+	if ((env = getenv("MO_GUARD_ALLOW"))) {
+		mo_rules_parse(env, &rules->allow);
+		if (!rules->allow.count)
+			fprintf(stderr, "mo: MO_GUARD_ALLOW matches nothing, nothing is guarded\n");
+	}
+	if ((env = getenv("MO_GUARD_DENY")))
+		mo_rules_parse(env, &rules->deny);
+	rules->enabled = rules->min || rules->max != SIZE_MAX ||
+		getenv("MO_GUARD_ALLOW") || rules->deny.count;
+}
+
+// open addressing, a slot is claimed by a CAS on its caller.
+static struct mo_site *
+mo_site_get(const void * caller)
+{
+	struct mo_site * sites = mo_ctx.adapt.sites;
+	uintptr_t key = (uintptr_t)caller;
+	unsigned i, n;
+
+	if (!sites || !key)
+		return NULL;
+	i = (key * 0x9E3779B97F4A7C15ULL) >> 52;
+	for (n=0; n<MO_SITES; n++, i = (i + 1) % MO_SITES) {
+		uintptr_t cur = __atomic_load_n(&sites[i].caller, __ATOMIC_ACQUIRE);
+		if (cur == key)
+			return &sites[i];
+		if (!cur) {
+			if (__atomic_compare_exchange_n(&sites[i].caller, &cur, key, 0,
+											__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return &sites[i];
+			if (cur == key)
+				return &sites[i];
+		}
+	}
+	return NULL;
+}
+
+
+// cpu cost is measured over the window since the last evaluation,
+// memory cost is what is held now.
+static void
+mo_adapt(void)
+{
+	struct mo_adapt * a = &mo_ctx.adapt;
+	struct mo_site * victim = NULL;
+	unsigned long victim_cost = 0;
+	int busy = 0;
+	unsigned i;
+
+	if (!__atomic_compare_exchange_n(&a->busy, &busy, 1, 0,
+									 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	uint64_t now = mo_ticks();
+	unsigned long ticks = __atomic_load_n(&a->ticks, __ATOMIC_RELAXED);
+	int over_cpu = a->cpu && (ticks - a->ticks_mark) * 100 > (now - a->now_mark) * a->cpu;
+	int over_mem = a->mem && __atomic_load_n(&a->live, __ATOMIC_RELAXED) > a->mem;
+
+	for (i=0; i<MO_SITES; i++) {
+		struct mo_site * site = &a->sites[i];
+		unsigned long site_ticks = __atomic_load_n(&site->ticks, __ATOMIC_RELAXED);
+		unsigned long cost = over_cpu ? site_ticks - site->ticks_mark :
+			__atomic_load_n(&site->live, __ATOMIC_RELAXED);
+		site->ticks_mark = site_ticks;
+		if (!site->caller || site->demoted || site->faults ||
+			__atomic_load_n(&site->allocs, __ATOMIC_RELAXED) < a->min)
+			continue;
+		if (cost > victim_cost) {
+			victim = site;
+			victim_cost = cost;
+		}
+	}
+	if ((over_cpu || over_mem) && victim) {
+		__atomic_store_n(&victim->demoted, 1, __ATOMIC_RELAXED);
+		a->demoted ++;
+	}
+	a->ticks_mark = ticks;
+	a->now_mark = now;
+	__atomic_store_n(&a->busy, 0, __ATOMIC_RELEASE);
+}
+
+// counters of the demotion policy, kept per thread, see mo_adapt_pend
+static void
+mo_site_account(struct mo_site * site, long allocs, size_t bytes, long live, uint64_t ticks)
+{
+	struct mo_adapt_pend * p = &mo_tstat.adapt;
+
+	if (!mo_ctx.adapt.enabled)
+		return;
+	if (site != p->site)
+		mo_site_flush(p);
+	p->site        = site;
+	p->allocs     += allocs;
+	p->bytes      += bytes;
+	p->ticks      += ticks;
+	p->live       += live;
+	p->all_allocs += allocs;
+	p->all_ticks  += ticks;
+	p->all_live   += live;
+	if (++p->calls >= MO_ADAPT_BATCH && mo_adapt_flush(p))
+		mo_adapt();
+}
+
+static void
+mo_adapt_init(struct mo_adapt * a)
+{
+	char * env;
+
+	if ((env = getenv("MO_ADAPT_CPU")))
+		a->cpu = atoi(env);
+	a->mem = mo_env_size("MO_ADAPT_MEM", 0);
+	a->min = mo_env_size("MO_ADAPT_MIN", a->min);
+	a->enabled = a->cpu || a->mem;
+	// MO_HEAP_REPORT names callers by their site as well
+	if (!a->enabled && !mo_ctx.live.top)
+		return;
+
+	a->sites = mo_syscall(mmap, NULL, MO_SITES * sizeof(struct mo_site), PROT_READ|PROT_WRITE,
+						  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (a->sites == MAP_FAILED) {
+		a->sites = NULL;
+		a->enabled = 0;
+	}
+	a->now_mark = mo_ticks();
+}
+
+// allocation and free stacks, MO_STACKS=<frames>. frame pointer walks
+// interned in the depot, a node keeps only the ids. MO_STACKS_DUMP=<file>
+// writes the depot and /proc/self/maps at exit, stacks.sh symbolizes it.
+// the depot, and our own code to leave out of its stacks
+static int
+mo_depot_init(void)
+{
+	static int ready;
+	Dl_info info;
+
+	if (ready)
+		return 0;
+	if (depot_init())
+		return -1;
+	if (dladdr((void *)mo_depot_init, &info) && info.dli_fname) {
+		struct mo_dso_match m = { info.dli_fname, &mo_ctx.self };
+		dl_iterate_phdr(mo_dso_ranges, &m);
+	}
+	ready = 1;
+	return 0;
+}
+
+static void
+mo_stack_init(void)
+{
+	size_t depth = mo_env_size("MO_STACKS", 0);
+
+	if (!depth)
+		return;
+	if (depth > DEPOT_FRAMES)
+		depth = DEPOT_FRAMES;
+	if (mo_depot_init()) {
+		fprintf(stderr, "mo: MO_STACKS: no room for the stack depot\n");
+		return;
+	}
+	mo_ctx.stack_dump = getenv("MO_STACKS_DUMP");
+	mo_ctx.stack_depth = depth;
+}
+
+// up to depth frames of the malloc or free caller
+static uint32_t
+mo_stack_capture(unsigned depth)
+{
+	uintptr_t pc[DEPOT_FRAMES];
+	unsigned n, skip = 0;
+
+	// a few more for our own frames
+	n = depot_capture(pc, depth + 8 < DEPOT_FRAMES ? depth + 8 : DEPOT_FRAMES);
+	while (skip < n && mo_ranges_match(&mo_ctx.self, pc[skip]))
+		skip++;
+	n -= skip;
+	return depot_put(pc + skip, n < depth ? n : depth);
+}
+
+// stack of the malloc or free caller, 0 without MO_STACKS
+static inline uint32_t
+mo_stack(void)
+{
+	if (__builtin_expect(!mo_ctx.stack_depth, 1))
+		return 0;
+	return mo_stack_capture(mo_ctx.stack_depth);
+}
+
+static void
+mo_stack_dump(const char * path)
+{
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+	if (fd < 0 || depot_dump(fd))
+		fprintf(stderr, "mo: cannot write the stacks to %s. errno=%d\n", path, errno);
+	if (fd >= 0)
+		close(fd);
+}
+
+// sampled heap profile, MO_PROF=<dir>. an allocation is sampled about
+// once every MO_PROF_RATE bytes, every MO_PROF_PERIOD seconds and at
+// exit the sampled blocks still live are written to
+// <dir>/heap.<pid>.<n>.pb, a pprof profile:
+//   go tool pprof -sample_index=inuse_space <binary> <dir>/heap.*.pb
+static void
+mo_prof_init(void)
+{
+	size_t rate = mo_env_size("MO_PROF_RATE", PROF_RATE);
+
+	mo_ctx.prof.dir = getenv("MO_PROF");
+	if (!mo_ctx.prof.dir || !*mo_ctx.prof.dir)
+		return;
+	mo_ctx.prof.period = mo_env_size("MO_PROF_PERIOD", 10);
+	if (mo_depot_init() || prof_init(rate)) {
+		fprintf(stderr, "mo: MO_PROF: no room for the heap profile\n");
+		return;
+	}
+	mkdir(mo_ctx.prof.dir, 0755);
+	mo_ctx.prof.rate = rate ? rate : 1;
+}
+
+// the table is mapped up front, a report does not call malloc
+static void
+mo_live_init(void)
+{
+	mo_ctx.live.top = mo_env_size("MO_HEAP_REPORT", 0);
+	if (!mo_ctx.live.top)
+		return;
+	if (mo_ctx.live.top > MO_LIVE_TOP)
+		mo_ctx.live.top = MO_LIVE_TOP;
+	mo_ctx.live.table = mo_syscall(mmap, NULL, MO_LIVE_SLOTS * sizeof(struct mo_live),
+								   PROT_READ|PROT_WRITE,
+								   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mo_ctx.live.table == MAP_FAILED || sem_init(&mo_ctx.live.wake, 0, 0)) {
+		fprintf(stderr, "mo: MO_HEAP_REPORT: no room for the report\n");
+		mo_ctx.live.table = NULL;
+		mo_ctx.live.top = 0;
+	}
+}
+
+static void
+mo_init(void)
+{
+	// order of the first pool segment, the pool grows on demand.
+	unsigned order = 14;
+	char * env = getenv("MO_POOL_ORDER");
+	if (env) {
+		order = atoi(env);
+	}
+	if (order <= 0) order = 14;
+
+	env = getenv("MO_REUSE_MEM");
+	if (env) {
+		mo_ctx.reuse_memory = atoi(env);
+	}
+
+	env = getenv("MO_POISON");
+	if (env) {
+		mo_ctx.poison = atoi(env);
+	}
+
+	env = getenv("MO_STATS");
+	if (env) {
+		mo_ctx.stats = atoi(env);
+	}
+
+	env = getenv("MO_LATENCY");
+	if (env) {
+		mo_ctx.latency = atoi(env);
+	}
+
+	env = getenv("MO_SEGV");
+	if (env) {
+		mo_ctx.segv.enabled = atoi(env);
+	}
+	mo_ctx.stat.ticks0 = mo_ticks();
+	clock_gettime(CLOCK_MONOTONIC, &mo_ctx.stat.time0);
+
+	env = getenv("MO_TREE_SHARDS");
+	if (env) {
+		int n = atoi(env);
+		if (n < 1) n = 1;
+		if (n > MO_SHARDS_MAX) n = MO_SHARDS_MAX;
+		mo_ctx.nshards = n;
+	}
+
+	env = getenv("MO_ARENA_PAGES");
+	if (env) {
+		int n = atoi(env);
+		if (n < 0) n = 0;
+		if (n > MO_ARENA_PAGES_MAX) n = MO_ARENA_PAGES_MAX;
+		mo_ctx.arena_pages = n;
+	}
+
+	mo_ctx.slab_max = mo_env_size("MO_SLAB_MAX", 0);
+	if (mo_ctx.slab_max > MO_SLAB_CLASSES * 16)
+		mo_ctx.slab_max = MO_SLAB_CLASSES * 16;
+
+	mo_ctx.quarantine_bytes = mo_env_size("MO_QUARANTINE_BYTES", 64 << 20);
+	mo_ctx.quarantine_spans = mo_env_size("MO_QUARANTINE_VMAS", 16384);
+
+	int rc = pool_chain_init(&mo_ctx.pool, order, sizeof(struct mo_rbnode));
+	assert(rc == 0);
+
+	rc = pthread_key_create(&mo_tcache_key, mo_tcache_flush);
+	assert(rc == 0);
+	rc = pthread_key_create(&mo_ctx.stat.key, mo_tstat_fold);
+	assert(rc == 0);
+	__atomic_store_n(&mo_ctx.stat.key_ready, 1, __ATOMIC_RELEASE);
+
+	env = getenv("MO_SAMPLE_RATE");
+	if (env) {
+		mo_ctx.sample_rate = atol(env);
+	}
+
+	canary_init();
+	mo_rules_init(&mo_ctx.rules);
+	mo_live_init();
+	mo_adapt_init(&mo_ctx.adapt);
+	mo_stack_init();
+	mo_prof_init();
+
+	sys_pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	sys_pageshift = __builtin_ctzl(sys_pagesize);
+
+	// the end of a block sits within MO_ALIGN - 1 bytes of the guard
+	size_t align = mo_env_size("MO_ALIGN", mo_ctx.align);
+	if (align && !(align & (align - 1)) && align <= sys_pagesize)
+		mo_ctx.align = align;
+
+	mo_next_init();
+
+	env = getenv("MO_TRACE");
+	if (env) {
+		mo_trace_open(env);
+	}
+}
+
+// the writer is started once libc is up, not from the first malloc
+__attribute__((constructor)) static void
+mo_trace_start(void)
+{
+	pthread_once(&mo_once, mo_init);
+	if (!mo_ctx.trace.enabled)
+		return;
+	pthread_atfork(NULL, NULL, mo_trace_atfork_child);
+	if (!pthread_create(&mo_ctx.trace.writer, NULL, mo_trace_writer, NULL))
+		mo_ctx.trace.running = 1;
+}
+
+static unsigned
+mo_tcache_refill(struct mo_tcache * tc)
+{
+	int rc;
+	struct mo_rbnode * node;
+
+	if (!tc->registered) {
+		// flush the magazine back to pool when thread exits.
+		rc = pthread_setspecific(mo_tcache_key, tc);
+		assert(rc == 0);
+		tc->registered = 1;
+	}
+	rc = mo_mutex_lock(&mo_ctx.pool_mutex, MO_LAT_POOL_LOCK);
+	assert(rc == 0);
+	while (tc->count < MO_TCACHE_BATCH) {
+		node = pool_chain_alloc(&mo_ctx.pool);
+		if (!node)
+			break;
+		tc->nodes[tc->count++] = node;
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+	assert(rc == 0);
+
+	return tc->count;
+}
+
+static void
+mo_tcache_drain(struct mo_tcache * tc)
+{
+	int rc, r;
+	unsigned i;
+
+	assert(tc->count >= MO_TCACHE_BATCH);
+	// give back the oldest ones, keep the recently freed (cache hot) nodes.
+	rc = mo_mutex_lock(&mo_ctx.pool_mutex, MO_LAT_POOL_LOCK);
+	assert(rc == 0);
+	for (i=0; i<MO_TCACHE_BATCH; i++) {
+		r = pool_chain_free(&mo_ctx.pool, tc->nodes[i]);
+		assert(r == 0);
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+	assert(rc == 0);
+
+	tc->count -= MO_TCACHE_BATCH;
+	memmove(&tc->nodes[0], &tc->nodes[MO_TCACHE_BATCH],
+			tc->count * sizeof(tc->nodes[0]));
+}
+
+static struct mo_rbnode *
+mo_rbnode_alloc()
+{
+	struct mo_tcache * tc = &mo_tcache;
+
+	if (!tc->count && !mo_tcache_refill(tc))
+		return NULL;
+
+	return tc->nodes[--tc->count];
+}
+static int
+mo_rbnode_free(struct mo_rbnode *node)
+{
+	struct mo_tcache * tc = &mo_tcache;
+
+	if (tc->count == MO_TCACHE_SIZE)
+		mo_tcache_drain(tc);
+	tc->nodes[tc->count++] = node;
+
+	return 0;
+}
+
+static struct mo_arena *
+mo_arena_new(unsigned pages)
+{
+	size_t slot = (pages + 1) * sys_pagesize;
+	size_t hdr  = sizeof(struct mo_arena) + cbt_bytes(MO_ARENA_SLOTS);
+	hdr = (hdr + sys_pagesize - 1) & ~(sys_pagesize - 1);
+	size_t size = hdr + sys_pagesize + MO_ARENA_SLOTS * slot;
+
+	void * ptr = mo_syscall(mmap, NULL, size, PROT_READ|PROT_WRITE,
+							MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	// every slot and guard page shut in one call
+	int markers = 0;
+#ifdef MADV_GUARD_INSTALL
+	markers = !mo_syscall(madvise, ptr + hdr, size - hdr, MADV_GUARD_INSTALL);
+#endif
+	if (!markers && mo_syscall(mprotect, ptr + hdr, size - hdr, PROT_NONE)) {
+		mo_syscall(munmap, ptr, size);
+		return NULL;
+	}
+	struct mo_arena * arena = ptr;
+	arena->next    = NULL;
+	arena->base    = (uintptr_t)ptr + hdr + sys_pagesize;
+	arena->size    = size;
+	arena->pages   = pages;
+	arena->markers = markers;
+	arena->used    = 0;
+	cbt_init(&arena->cbt, arena + 1, MO_ARENA_SLOTS);
+	return arena;
+}
+
+static void *
+mo_arena_alloc(unsigned pages, struct mo_arena ** owner)
+{
+	int rc;
+	size_t idx;
+	struct mo_arena_class * c = &mo_ctx.arenas[pages];
+	struct mo_arena * arena;
+
+	rc = mo_mutex_lock(&c->mutex, MO_LAT_CLASS_LOCK);
+	assert(rc == 0);
+	arena = c->hint;
+	if (!arena || arena->used == MO_ARENA_SLOTS) {
+		for (arena = c->head; arena; arena = arena->next) {
+			if (arena->used < MO_ARENA_SLOTS)
+				break;
+		}
+	}
+	if (!arena) {
+		arena = mo_arena_new(pages);
+		if (arena) {
+			arena->next = c->head;
+			c->head = arena;
+		}
+	}
+	if (arena) {
+		idx = cbt_alloc(&arena->cbt);
+		assert(idx != (size_t)-1);
+		arena->used ++;
+		c->hint = arena;
+	}
+	rc = pthread_mutex_unlock(&c->mutex);
+	assert(rc == 0);
+
+	if (!arena)
+		return NULL;
+	*owner = arena;
+	return (void *)(arena->base + idx * (pages + 1) * sys_pagesize);
+}
+
+// open a slot, or shut it: its data pages trap from then on.
+// shutting with guard markers drops the pages as well.
+static int
+mo_arena_protect(struct mo_arena * arena, void * ptr, int open)
+{
+	size_t len = arena->pages * sys_pagesize;
+#ifdef MADV_GUARD_INSTALL
+	if (arena->markers)
+		return mo_syscall(madvise, ptr, len, open ? MADV_GUARD_REMOVE : MADV_GUARD_INSTALL);
+#endif
+	return mo_syscall(mprotect, ptr, len, open ? PROT_READ|PROT_WRITE : PROT_NONE);
+}
+
+// data pages are dropped, the slot goes back to PROT_NONE.
+// mapping fresh PROT_NONE pages over the slot does both in one syscall,
+// so do guard markers.
+static int
+mo_arena_free(struct mo_rbnode * node, int cached)
+{
+	int rc;
+	void * ptr;
+	struct mo_arena * arena = node->arena;
+	struct mo_arena_class * c = &mo_ctx.arenas[arena->pages];
+	size_t idx = (node->pages.ptr - arena->base) / ((arena->pages + 1) * sys_pagesize);
+
+	if (!cached || !node->released) {
+		if (arena->markers)
+			ptr = mo_arena_protect(arena, (void *)node->pages.ptr, 0) ? MAP_FAILED : NULL;
+		else
+			ptr = mo_syscall(mmap, (void *)node->pages.ptr, arena->pages * sys_pagesize, PROT_NONE,
+							 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0);
+		if (ptr == MAP_FAILED) {
+			fprintf(stderr, "arena free failed. errno=%d \n", errno);
+			return -1;
+		}
+	}
+
+	rc = mo_mutex_lock(&c->mutex, MO_LAT_CLASS_LOCK);
+	assert(rc == 0);
+	cbt_free(&arena->cbt, idx);
+	arena->used --;
+	rc = pthread_mutex_unlock(&c->mutex);
+	assert(rc == 0);
+	return 0;
+}
+
+static void *
+mo_page_alloc(size_t pages, struct mo_arena ** arena)
+{
+	int rc;
+	void * ptr;
+
+	*arena = NULL;
+	if (pages <= mo_ctx.arena_pages) {
+		ptr = mo_arena_alloc(pages, arena);
+		if (ptr) {
+			rc = mo_arena_protect(*arena, ptr, 1);
+			if (!rc)
+				return ptr;
+			fprintf(stderr, "mprotect failed. errno=%d \n", errno);
+			assert(0 && "mprotect failed");
+			return NULL;
+		}
+		// no arena, fall back to mmap
+	}
+	ptr = mo_syscall(mmap, NULL,
+			   (1+pages)*sys_pagesize,
+			   PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS,
+			   -1, //NOFD,
+			   0);
+	assert(ptr != MAP_FAILED);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+	rc = mo_syscall(mprotect, ptr+pages*sys_pagesize, sys_pagesize, PROT_NONE);
+	if (rc) {
+		fprintf(stderr, "mprotect failed. errno=%d \n", errno);
+		assert(0 && "mprotect failed");
+	}
+	assert(rc == 0);
+	return ptr;
+}
+
+// cached: span sits in span cache, pages are PROT_NONE already.
+static int
+mo_page_free(struct mo_rbnode * node, int cached)
+{
+	int rc;
+	assert(node);
+	mo_map_set(node->pages.ptr, node->pages.num, NULL);
+	if (node->arena)
+		return mo_arena_free(node, cached);
+	rc = mo_syscall(munmap, (void *)node->pages.ptr, node->pages.num * sys_pagesize);
+	if (rc) {
+		fprintf(stderr, "munmap failed. errno=%d \n", errno);
+	}
+	return rc;
+}
+
+static struct mo_slab *
+mo_slab_new(unsigned cls)
+{
+	unsigned stride = cls * 16 + MO_REDZONE;
+	size_t slots = MO_SLAB_PAGES * sys_pagesize / stride;
+	size_t hdr = sizeof(struct mo_slab) + cbt_bytes(slots) + slots * sizeof(uint16_t);
+	size_t stacks = (hdr + 3) & ~(size_t)3;
+	if (mo_ctx.stack_depth)
+		hdr = stacks + slots * 2 * sizeof(uint32_t);
+	size_t sampled = (hdr + 7) & ~(size_t)7;
+	if (mo_ctx.prof.rate)
+		hdr = sampled + (slots + 63) / 64 * sizeof(uint64_t);
+	hdr = (hdr + sys_pagesize-1) & ~(sys_pagesize-1);
+	size_t size = hdr + (MO_SLAB_PAGES + 2) * sys_pagesize;
+
+	void * ptr = mo_syscall(mmap, NULL, size, PROT_NONE,
+							MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	if (mo_syscall(mprotect, ptr, hdr, PROT_READ|PROT_WRITE) ||
+		mo_syscall(mprotect, ptr + hdr + sys_pagesize, MO_SLAB_PAGES * sys_pagesize,
+				   PROT_READ|PROT_WRITE)) {
+		fprintf(stderr, "mprotect failed. errno=%d \n", errno);
+		mo_syscall(munmap, ptr, size);
+		return NULL;
+	}
+
+	struct mo_slab * slab = ptr;
+	slab->next   = NULL;
+	slab->base   = (uintptr_t)ptr + hdr + sys_pagesize;
+	slab->size   = size;
+	slab->stride = stride;
+	slab->slots  = slots;
+	slab->used   = 0;
+	cbt_init(&slab->cbt, slab + 1, slots);
+	slab->user   = (uint16_t *)((char *)(slab + 1) + cbt_bytes(slots));
+	slab->stacks = mo_ctx.stack_depth ? (uint32_t *)((char *)ptr + stacks) : NULL;
+	slab->sampled = mo_ctx.prof.rate ? (uint64_t *)((char *)ptr + sampled) : NULL;
+
+	if (mo_ctx.poison)
+		canary_fill((void *)slab->base, slots * stride, MO_CANARY);
+
+	slab->node.state     = MO_NODE_SLAB;
+	slab->node.pages.ptr = slab->base;
+	slab->node.pages.num = MO_SLAB_PAGES + 1;
+	mo_map_set(slab->node.pages.ptr, slab->node.pages.num, &slab->node);
+	return slab;
+}
+
+// at: offset of the broken byte from ptr
+static void
+mo_corrupt(void * ptr, size_t size, long at, const char * what, const char * when)
+{
+	fprintf(stderr, "mo: %s of %p (%zu bytes): canary broken at %+ld, found on %s\n",
+			what, ptr, size, at, when);
+}
+
+static void *
+mo_slab_alloc(size_t size, uint32_t stack)
+{
+	int rc;
+	size_t idx;
+	unsigned cls = (size + 15) / 16;
+	struct mo_slab_class * c = &mo_ctx.slabs[cls];
+	struct mo_slab * slab;
+
+	rc = mo_mutex_lock(&c->mutex, MO_LAT_CLASS_LOCK);
+	assert(rc == 0);
+	slab = c->hint;
+	if (!slab || slab->used == slab->slots) {
+		for (slab = c->head; slab; slab = slab->next) {
+			if (slab->used < slab->slots)
+				break;
+		}
+	}
+	if (!slab) {
+		slab = mo_slab_new(cls);
+		if (slab) {
+			slab->next = c->head;
+			c->head = slab;
+		}
+	}
+	if (slab) {
+		idx = cbt_alloc(&slab->cbt);
+		assert(idx != (size_t)-1);
+		slab->user[idx] = size;
+		if (slab->stacks) {
+			slab->stacks[2*idx] = stack;
+			slab->stacks[2*idx + 1] = 0;
+		}
+		slab->used ++;
+		c->hint = slab;
+	}
+	rc = pthread_mutex_unlock(&c->mutex);
+	assert(rc == 0);
+
+	if (!slab)
+		return NULL;
+	char * ptr = (char *)(slab->base + idx * slab->stride);
+	if (mo_ctx.poison) {
+		size_t at = canary_check(ptr, slab->stride, MO_CANARY);
+		if (at != slab->stride) {
+			mo_corrupt(ptr, 0, at, "write after free", "malloc");
+			abort();
+		}
+	} else {
+		canary_fill(ptr + size, slab->stride - size, MO_CANARY);
+	}
+	return ptr;
+}
+
+#define mo_slab_of(node)	((struct mo_slab *)((char *)(node) - offsetof(struct mo_slab, node)))
+
+// requested size of a live slab object, 0 if ptr is not one
+static size_t
+mo_slab_size(struct mo_slab * slab, void * ptr)
+{
+	size_t off = (uintptr_t)ptr - slab->base;
+	if (off % slab->stride)
+		return 0;
+	return __atomic_load_n(&slab->user[off / slab->stride], __ATOMIC_RELAXED);
+}
+
+static void
+mo_slab_free(struct mo_slab * slab, void * ptr, uint32_t stack)
+{
+	int rc;
+	uint64_t sampled = 0;
+	size_t size, at;
+	size_t idx = ((uintptr_t)ptr - slab->base) / slab->stride;
+	struct mo_slab_class * c = &mo_ctx.slabs[(slab->stride - MO_REDZONE) / 16];
+
+	size = mo_slab_size(slab, ptr);
+	if (!size) {
+		assert(0 && "unable to find the ptr");
+		return;
+	}
+	at = canary_check((char *)ptr + size, slab->stride - size, MO_CANARY);
+	if (at != slab->stride - size) {
+		mo_corrupt(ptr, size, size + at, "heap overflow", "free");
+		abort();
+	}
+	if (mo_ctx.poison)
+		canary_fill(ptr, size, MO_CANARY);
+
+	rc = mo_mutex_lock(&c->mutex, MO_LAT_CLASS_LOCK);
+	assert(rc == 0);
+	if (!slab->user[idx]) {
+		// lost a double free race
+		rc = pthread_mutex_unlock(&c->mutex);
+		assert(0 && "unable to find the ptr");
+		return;
+	}
+	slab->user[idx] = 0;
+	if (slab->stacks)
+		slab->stacks[2*idx + 1] = stack;
+	// set before the block was handed out, a plain load sees it
+	if (slab->sampled && slab->sampled[idx / 64] & 1ULL << idx % 64) {
+		__atomic_fetch_and(&slab->sampled[idx / 64], ~(1ULL << idx % 64), __ATOMIC_RELAXED);
+		sampled = 1;
+	}
+	cbt_free(&slab->cbt, idx);
+	slab->used --;
+	rc = pthread_mutex_unlock(&c->mutex);
+	assert(rc == 0);
+	if (sampled)
+		prof_free(ptr);
+	mo_count(frees, 1);
+	mo_count_bytes(-(long)size);
+}
+
+int
+mo_check(void)
+{
+	int rc, broken = 0;
+	unsigned i;
+	size_t idx, at;
+	struct mo_slab * slab;
+
+	for (i=1; i<=MO_SLAB_CLASSES; i++) {
+		struct mo_slab_class * c = &mo_ctx.slabs[i];
+		rc = mo_mutex_lock(&c->mutex, MO_LAT_CLASS_LOCK);
+		assert(rc == 0);
+		for (slab = c->head; slab; slab = slab->next) {
+			for (idx=0; idx<slab->slots; idx++) {
+				size_t size = slab->user[idx];
+				char * ptr = (char *)(slab->base + idx * slab->stride);
+				if (!size) {
+					if (mo_ctx.poison &&
+						(at = canary_check(ptr, slab->stride, MO_CANARY)) != slab->stride) {
+						mo_corrupt(ptr, 0, at, "write after free", "check");
+						broken ++;
+					}
+					continue;
+				}
+				at = canary_check(ptr + size, slab->stride - size, MO_CANARY);
+				if (at != slab->stride - size) {
+					mo_corrupt(ptr, size, size + at, "heap overflow", "check");
+					broken ++;
+				}
+			}
+		}
+		rc = pthread_mutex_unlock(&c->mutex);
+		assert(rc == 0);
+	}
+	return broken;
+}
+
+// fault report, MO_SEGV=1. a SIGSEGV on one of our guard pages or on a
+// freed span names the block: the page map and the node are read
+// without a lock, nothing is allocated, the output is made by hand.
+// the faulting thread may hold any of our locks. the handler found at
+// install time is put back, the access faults again and goes to it.
+struct mo_segv_out {
+	size_t len;
+	char   buf[4096];
+};
+
+static void
+mo_segv_flush(struct mo_segv_out * o)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < o->len) {
+		n = write(STDERR_FILENO, o->buf + done, o->len - done);
+		if (n > 0)
+			done += n;
+		else if (n < 0 && errno != EINTR)
+			break;
+	}
+	o->len = 0;
+}
+
+static void
+mo_segv_str(struct mo_segv_out * o, const char * s)
+{
+	while (*s) {
+		if (o->len == sizeof(o->buf))
+			mo_segv_flush(o);
+		o->buf[o->len++] = *s++;
+	}
+}
+
+static void
+mo_segv_num(struct mo_segv_out * o, uint64_t v, int hex)
+{
+	char s[24];
+	int i = sizeof(s);
+
+	s[--i] = 0;
+	do {
+		s[--i] = "0123456789abcdef"[hex ? v & 15 : v % 10];
+		v = hex ? v >> 4 : v / 10;
+	} while (v);
+	if (hex) {
+		s[--i] = 'x';
+		s[--i] = '0';
+	}
+	mo_segv_str(o, s + i);
+}
+
+static void
+mo_segv_stack(struct mo_segv_out * o, const char * what, uint32_t id)
+{
+	const uintptr_t * pc;
+	unsigned i, n;
+
+	if (!id || !(pc = depot_get(id, &n)))
+		return;
+	mo_segv_str(o, "mo:   ");
+	mo_segv_str(o, what);
+	mo_segv_str(o, " stack ");
+	mo_segv_num(o, id, 1);
+	mo_segv_str(o, ":");
+	for (i=0; i<n; i++) {
+		mo_segv_str(o, " ");
+		mo_segv_num(o, pc[i], 1);
+	}
+	mo_segv_str(o, "\n");
+}
+
+// the span or slab of the page, or of the next one: an underflow of a
+// slab lands on the guard page in front of it
+static void
+mo_segv_report(uintptr_t addr)
+{
+	struct mo_segv_out o = { 0 };
+	struct mo_rbnode * node = mo_rbnode_lookup((void *)addr);
+	uintptr_t ptr;
+	size_t size;
+	uint32_t alloc_stack, free_stack;
+	int live;
+
+	if (!node)
+		node = mo_rbnode_lookup((void *)(addr + sys_pagesize));
+	mo_segv_str(&o, "mo: SIGSEGV at ");
+	mo_segv_num(&o, addr, 1);
+	if (!node) {
+		mo_segv_str(&o, ", not in a block of ours\n");
+		mo_segv_flush(&o);
+		return;
+	}
+	if (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == MO_NODE_SLAB) {
+		struct mo_slab * slab = mo_slab_of(node);
+		size_t idx = addr < slab->base ? 0 : (addr - slab->base) / slab->stride;
+		if (idx >= slab->slots)
+			idx = slab->slots - 1;
+		ptr  = slab->base + idx * slab->stride;
+		size = __atomic_load_n(&slab->user[idx], __ATOMIC_RELAXED);
+		live = size != 0;
+		alloc_stack = slab->stacks ? slab->stacks[2*idx] : 0;
+		free_stack  = slab->stacks ? slab->stacks[2*idx + 1] : 0;
+	} else {
+		ptr  = node->user.ptr;
+		size = node->user.size;
+		live = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == MO_NODE_LIVE;
+		alloc_stack = node->alloc_stack;
+		free_stack  = node->free_stack;
+	}
+
+	if (!live) {
+		mo_segv_str(&o, ", use after free, ");
+		mo_segv_num(&o, addr >= ptr ? addr - ptr : ptr - addr, 0);
+		mo_segv_str(&o, addr >= ptr ? " bytes into " : " bytes before ");
+	} else if (addr >= ptr + size) {
+		mo_segv_str(&o, ", heap overflow, ");
+		mo_segv_num(&o, addr - (ptr + size), 0);
+		mo_segv_str(&o, " bytes past the end of ");
+	} else if (addr < ptr) {
+		mo_segv_str(&o, ", heap underflow, ");
+		mo_segv_num(&o, ptr - addr, 0);
+		mo_segv_str(&o, " bytes before ");
+	} else {
+		mo_segv_str(&o, ", ");
+		mo_segv_num(&o, addr - ptr, 0);
+		mo_segv_str(&o, " bytes into ");
+	}
+	mo_segv_num(&o, ptr, 1);
+	mo_segv_str(&o, " (");
+	mo_segv_num(&o, size, 0);
+	mo_segv_str(&o, live ? " bytes)\n" : " bytes, freed)\n");
+	mo_segv_stack(&o, "alloc", alloc_stack);
+	if (!live)
+		mo_segv_stack(&o, "free", free_stack);
+	mo_segv_flush(&o);
+}
+
+static void
+mo_segv(int sig, siginfo_t * si, void * uc)
+{
+	int saved = errno;
+
+	(void)uc;
+	mo_segv_report((uintptr_t)si->si_addr);
+	if (mo_ctx.stack_dump) {
+		int fd = open(mo_ctx.stack_dump, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if (fd >= 0) {
+			depot_dump(fd);
+			close(fd);
+		}
+	}
+	sigaction(SIGSEGV, &mo_ctx.segv.old, NULL);
+	errno = saved;
+	// sent, not a fault: nothing runs again
+	if (si->si_code <= 0)
+		raise(sig);
+}
+
+__attribute__((constructor)) static void
+mo_segv_start(void)
+{
+	struct sigaction sa = { .sa_sigaction = mo_segv, .sa_flags = SA_SIGINFO|SA_ONSTACK };
+
+	pthread_once(&mo_once, mo_init);
+	if (!mo_ctx.segv.enabled)
+		return;
+	// other threads get theirs as they first allocate, see mo_tstat_register
+	if (!mo_tstat.altstack)
+		mo_tstat.altstack = mo_segv_altstack();
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &mo_ctx.segv.old);
+}
+
+#define mo_span_list_push(l, node, field)								\
+	{																	\
+		(node)->field.next = NULL;										\
+		(node)->field.prev = (l)->tail;								\
+		if ((l)->tail)													\
+			(l)->tail->field.next = (node);							\
+		else															\
+			(l)->head = (node);										\
+		(l)->tail = (node);											\
+	}
+
+#define mo_span_list_insert(l, at, node, field)							\
+	{																	\
+		(node)->field.next = (at);										\
+		(node)->field.prev = (at)->field.prev;							\
+		if ((at)->field.prev)											\
+			(at)->field.prev->field.next = (node);						\
+		else															\
+			(l)->head = (node);											\
+		(at)->field.prev = (node);										\
+	}
+
+#define mo_span_list_remove(l, node, field)							\
+	{																	\
+		if ((node)->field.prev)										\
+			(node)->field.prev->field.next = (node)->field.next;		\
+		else															\
+			(l)->head = (node)->field.next;							\
+		if ((node)->field.next)										\
+			(node)->field.next->field.prev = (node)->field.prev;		\
+		else															\
+			(l)->tail = (node)->field.prev;							\
+	}
+
+#define mo_span_bytes(node)	(((size_t)(node)->pages.num - 1) * sys_pagesize)
+
+// the calling thread's shard, dealt on first use
+static inline struct mo_page_shard *
+mo_page_shard(void)
+{
+	if (__builtin_expect(!mo_shard, 0))
+		mo_shard = __atomic_fetch_add(&mo_ctx.shard_next, 1, __ATOMIC_RELAXED) % mo_ctx.nshards + 1;
+	return &mo_ctx.page_tree[mo_shard - 1];
+}
+
+// take a span out of the cache, shard lock held.
+static void
+mo_span_unlink(struct mo_page_shard * s, struct mo_rbnode * node)
+{
+	unsigned num = node->pages.num;
+
+	if (num <= MO_SPAN_CLASSES)
+		mo_span_list_remove(&s->classes[num], node, class_entry)
+	else
+		RB_REMOVE(mo_rbnode_page_tree, &s->tree, node);
+	if (s->fresh == node)
+		s->fresh = node->age_entry.next;
+	mo_span_list_remove(&s->age, node, age_entry);
+	if (!node->released)
+		s->bytes -= mo_span_bytes(node);
+	s->spans --;
+}
+
+// enforce the shard budgets, shard lock held.
+// spans to unmap are chained on class_entry and returned,
+// munmap is left to the caller after unlock.
+static struct mo_rbnode *
+mo_span_evict(struct mo_page_shard * s)
+{
+	struct mo_rbnode * node, * victims = NULL;
+	unsigned n = __atomic_load_n(&mo_ctx.shard_next, __ATOMIC_RELAXED);
+	if (n > mo_ctx.nshards)
+		n = mo_ctx.nshards;
+	size_t max_bytes = mo_ctx.quarantine_bytes / n;
+	size_t max_spans = mo_ctx.quarantine_spans / n;
+	if (!max_spans)
+		max_spans = 1;
+
+	while (s->spans > max_spans) {
+		node = s->age.head;
+		mo_span_unlink(s, node);
+		node->class_entry.next = victims;
+		victims = node;
+		s->evicts ++;
+	}
+	while (s->bytes > max_bytes && s->fresh) {
+		node = s->fresh;
+		s->fresh = node->age_entry.next;
+#ifdef MADV_DONTNEED
+		if (mo_syscall(madvise, (void *)node->pages.ptr, mo_span_bytes(node), MADV_DONTNEED))
+			fprintf(stderr, "madvise failed. errno=%d \n", errno);
+#endif
+		node->released = 1;
+		s->bytes -= mo_span_bytes(node);
+	}
+	return victims;
+}
+
+static void
+mo_span_put(struct mo_rbnode * node)
+{
+	int rc;
+	unsigned num = node->pages.num;
+	struct mo_page_shard * s = mo_page_shard();
+	struct mo_rbnode * victims;
+
+	rc = mo_mutex_lock(&s->mutex, MO_LAT_SHARD_LOCK);
+	assert(rc == 0);
+	uint64_t t0 = mo_lat_start();
+	node->seq = ++s->seq;
+	if (num <= MO_SPAN_CLASSES)
+		mo_span_list_push(&s->classes[num], node, class_entry)
+	else
+		RB_INSERT(mo_rbnode_page_tree, &s->tree, node);
+	// a madvised span, the rest of a split one, joins the others ahead of fresh
+	if (node->released && s->fresh)
+		mo_span_list_insert(&s->age, s->fresh, node, age_entry)
+	else
+		mo_span_list_push(&s->age, node, age_entry);
+	if (!node->released) {
+		s->bytes += mo_span_bytes(node);
+		if (!s->fresh)
+			s->fresh = node;
+	}
+	s->spans ++;
+	victims = mo_span_evict(s);
+	mo_lat_end(MO_LAT_TREE, t0);
+	rc = pthread_mutex_unlock(&s->mutex);
+	assert(rc == 0);
+
+	while (victims) {
+		node = victims;
+		victims = node->class_entry.next;
+		mo_page_free(node, 1);
+		mo_rbnode_free(node);
+	}
+}
+
+// oldest span of a size class, own shard first, then the others
+static struct mo_rbnode *
+mo_span_pop(unsigned num)
+{
+	int rc;
+	unsigned i, home = mo_page_shard() - mo_ctx.page_tree;
+	struct mo_page_shard * s;
+	struct mo_rbnode * node = NULL;
+
+	for (i=0; i<mo_ctx.nshards && !node; i++) {
+		s = &mo_ctx.page_tree[(home + i) % mo_ctx.nshards];
+		if (!s->classes[num].head)
+			continue;
+		rc = mo_mutex_lock(&s->mutex, MO_LAT_SHARD_LOCK);
+		assert(rc == 0);
+		uint64_t t0 = mo_lat_start();
+		node = s->classes[num].head;
+		if (node)
+			mo_span_unlink(s, node);
+		mo_lat_end(MO_LAT_TREE, t0);
+		rc = pthread_mutex_unlock(&s->mutex);
+		assert(rc == 0);
+	}
+	return node;
+}
+
+// smallest span in page_tree with at least num pages, oldest first.
+static struct mo_rbnode *
+mo_span_best_fit(unsigned num)
+{
+	int rc;
+	unsigned i, best = 0, bi = 0, home = mo_page_shard() - mo_ctx.page_tree;
+	struct mo_rbnode f = { .pages.num = num }, * r;
+	struct mo_page_shard * s;
+
+	// own shard first, it wins a tie
+	for (i=0; i<mo_ctx.nshards && best != num; i++) {
+		s = &mo_ctx.page_tree[(home + i) % mo_ctx.nshards];
+		if (!RB_ROOT_(&s->tree))
+			continue;
+		rc = mo_mutex_lock(&s->mutex, MO_LAT_SHARD_LOCK);
+		assert(rc == 0);
+		r = RB_NFIND(mo_rbnode_page_tree, &s->tree, &f);
+		if (r && (!best || r->pages.num < best)) {
+			best = r->pages.num;
+			bi = (home + i) % mo_ctx.nshards;
+		}
+		rc = pthread_mutex_unlock(&s->mutex);
+		assert(rc == 0);
+	}
+	if (!best)
+		return NULL;
+
+	// it may be gone meanwhile, take whatever fits in that shard.
+	s = &mo_ctx.page_tree[bi];
+	rc = mo_mutex_lock(&s->mutex, MO_LAT_SHARD_LOCK);
+	assert(rc == 0);
+	uint64_t t0 = mo_lat_start();
+	r = RB_NFIND(mo_rbnode_page_tree, &s->tree, &f);
+	if (r)
+		mo_span_unlink(s, r);
+	mo_lat_end(MO_LAT_TREE, t0);
+	rc = pthread_mutex_unlock(&s->mutex);
+	assert(rc == 0);
+	return r;
+}
+
+// keep the first num pages of a cached span, page num-1 becomes the
+// guard (PROT_NONE already). the rest goes back to the cache as a span
+// of its own, or is unmapped when it is too small to hold data + guard.
+static void
+mo_span_split(struct mo_rbnode * node, unsigned num)
+{
+	unsigned rest = node->pages.num - num;
+	uintptr_t ptr = node->pages.ptr + num * sys_pagesize;
+	struct mo_rbnode * r = NULL;
+
+	assert(node->pages.num > num && !node->arena);
+	node->pages.num = num;
+	if (rest >= 2)
+		r = mo_rbnode_alloc();
+	if (r) {
+		memset(r, 0, sizeof(*r));
+		r->pages.ptr = ptr;
+		r->pages.num = rest;
+		r->released  = node->released;
+		mo_map_set(ptr, rest, r);
+		mo_span_put(r);
+	} else {
+		mo_map_set(ptr, rest, NULL);
+		if (mo_syscall(munmap, (void *)ptr, rest * sys_pagesize))
+			fprintf(stderr, "munmap failed. errno=%d \n", errno);
+	}
+	__atomic_add_fetch(&mo_page_shard()->splits, 1, __ATOMIC_RELAXED);
+}
+
+// a cached span of num pages, guard included.
+// exact size class first, then a slightly larger class, then best fit.
+static struct mo_rbnode *
+mo_span_get(unsigned num)
+{
+	unsigned n;
+	struct mo_rbnode * node = NULL;
+
+	if (num <= MO_SPAN_CLASSES) {
+		node = mo_span_pop(num);
+		if (node)
+			return node;
+		// arena slots can not be split, larger classes are worth
+		// a look only above the arena sizes.
+		n = num + 1;
+		if (n <= mo_ctx.arena_pages + 1)
+			n = MO_SPAN_CLASSES + 1;
+		for (; n<=MO_SPAN_CLASSES && n<=2*num && !node; n++)
+			node = mo_span_pop(n);
+	}
+	if (!node)
+		node = mo_span_best_fit(num);
+	if (!node) {
+		mo_count(misses, 1);
+		return NULL;
+	}
+	mo_count(hits, 1);
+	if (node->pages.num > num)
+		mo_span_split(node, num);
+	return node;
+}
+
+void
+mo_stats(struct mo_stats * st)
+{
+	int rc;
+	unsigned i;
+	struct mo_tstat * t;
+	struct mo_counters c;
+	long live;
+
+	rc = pthread_mutex_lock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+	c = mo_ctx.stat.retired;
+	live = __atomic_load_n(&mo_ctx.stat.live, __ATOMIC_RELAXED);
+	for (t = mo_ctx.stat.threads; t; t = t->next) {
+		c.mallocs  += __atomic_load_n(&t->c.mallocs, __ATOMIC_RELAXED);
+		c.frees    += __atomic_load_n(&t->c.frees, __ATOMIC_RELAXED);
+		c.mmap     += __atomic_load_n(&t->c.mmap, __ATOMIC_RELAXED);
+		c.mprotect += __atomic_load_n(&t->c.mprotect, __ATOMIC_RELAXED);
+		c.munmap   += __atomic_load_n(&t->c.munmap, __ATOMIC_RELAXED);
+		c.madvise  += __atomic_load_n(&t->c.madvise, __ATOMIC_RELAXED);
+		c.mremap   += __atomic_load_n(&t->c.mremap, __ATOMIC_RELAXED);
+		c.hits     += __atomic_load_n(&t->c.hits, __ATOMIC_RELAXED);
+		c.misses   += __atomic_load_n(&t->c.misses, __ATOMIC_RELAXED);
+		live       += __atomic_load_n(&t->c.bytes, __ATOMIC_RELAXED);
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+
+	memset(st, 0, sizeof(*st));
+	st->mallocs      = c.mallocs;
+	st->frees        = c.frees;
+	st->live_bytes   = live > 0 ? live : 0;
+	st->peak_bytes   = __atomic_load_n(&mo_ctx.stat.peak, __ATOMIC_RELAXED);
+	if (st->peak_bytes < st->live_bytes)
+		st->peak_bytes = st->live_bytes;
+	st->mmap         = c.mmap;
+	st->mprotect     = c.mprotect;
+	st->munmap       = c.munmap;
+	st->madvise      = c.madvise;
+	st->mremap       = c.mremap;
+	st->reuse_hits   = c.hits;
+	st->reuse_misses = c.misses;
+
+	rc = mo_mutex_lock(&mo_ctx.pool_mutex, MO_LAT_POOL_LOCK);
+	assert(rc == 0);
+	st->pool_segments = mo_ctx.pool.count;
+	for (i=0; i<mo_ctx.pool.count; i++) {
+		st->pool_used     += mo_ctx.pool.segs[i]->used;
+		st->pool_capacity += mo_ctx.pool.segs[i]->ecount;
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+	assert(rc == 0);
+
+	// shard counters change under the shard lock, a racy sum is enough
+	for (i=0; i<mo_ctx.nshards; i++) {
+		struct mo_page_shard * s = &mo_ctx.page_tree[i];
+		st->cached_spans += __atomic_load_n(&s->spans, __ATOMIC_RELAXED);
+		st->cached_bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+		st->splits       += __atomic_load_n(&s->splits, __ATOMIC_RELAXED);
+		st->evicts       += __atomic_load_n(&s->evicts, __ATOMIC_RELAXED);
+	}
+
+	for (i=1; i<=MO_SLAB_CLASSES; i++) {
+		struct mo_slab_class * sc = &mo_ctx.slabs[i];
+		struct mo_slab * slab;
+		rc = pthread_mutex_lock(&sc->mutex);
+		assert(rc == 0);
+		for (slab = sc->head; slab; slab = slab->next) {
+			st->slabs ++;
+			st->slab_objects += slab->used;
+		}
+		rc = pthread_mutex_unlock(&sc->mutex);
+		assert(rc == 0);
+	}
+}
+
+static const char * mo_lat_names[MO_LAT_MAX] = {
+	[MO_LAT_MALLOC]     = "malloc",
+	[MO_LAT_FREE]       = "free",
+	[MO_LAT_REALLOC]    = "realloc",
+	[MO_LAT_POOL_LOCK]  = "pool lock",
+	[MO_LAT_SHARD_LOCK] = "shard lock",
+	[MO_LAT_CLASS_LOCK] = "class lock",
+	[MO_LAT_SYSCALL]    = "syscall",
+	[MO_LAT_TREE]       = "tree",
+};
+
+// percentiles are the upper bound of their bucket, within 25%.
+static void
+mo_lat_report(void)
+{
+	static struct mo_hist h;
+	struct mo_tstat * t;
+	struct timespec now;
+	unsigned i, j, k;
+	int rc;
+
+	rc = pthread_mutex_lock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+	h = mo_ctx.stat.hist;
+	for (t = mo_ctx.stat.threads; t; t = t->next) {
+		struct mo_hist * th = __atomic_load_n(&t->hist, __ATOMIC_ACQUIRE);
+		if (!th)
+			continue;
+		for (i=0; i<MO_LAT_MAX; i++) {
+			for (j=0; j<MO_LAT_BUCKETS; j++)
+				h.count[i][j] += __atomic_load_n(&th->count[i][j], __ATOMIC_RELAXED);
+			if (h.max[i] < th->max[i])
+				h.max[i] = th->max[i];
+		}
+	}
+	rc = pthread_mutex_unlock(&mo_ctx.stat.mutex);
+	assert(rc == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - mo_ctx.stat.time0.tv_sec) * 1e9 +
+		(now.tv_nsec - mo_ctx.stat.time0.tv_nsec);
+	uint64_t ticks = mo_ticks() - mo_ctx.stat.ticks0;
+	double tick_ns = ticks ? ns / ticks : 1.0;
+
+	for (i=0; i<MO_LAT_MAX; i++) {
+		static const double pct[3] = { 0.5, 0.99, 0.999 };
+		double p[3] = { 0 };
+		uint64_t total = 0, sum = 0;
+		for (j=0; j<MO_LAT_BUCKETS; j++)
+			total += h.count[i][j];
+		if (!total)
+			continue;
+		for (j=0, k=0; j<MO_LAT_BUCKETS && k<3; j++) {
+			sum += h.count[i][j];
+			while (k<3 && sum >= pct[k] * total) {
+				uint64_t v = mo_lat_value(j + 1) - 1;
+				p[k++] = (v < h.max[i] ? v : h.max[i]) * tick_ns;
+			}
+		}
+		fprintf(stderr, "mo: latency %-10s %10lu calls, p50 %8.0f ns, p99 %8.0f ns, "
+				"p999 %8.0f ns, max %10.0f ns\n", mo_lat_names[i], (unsigned long)total,
+				p[0], p[1], p[2], h.max[i] * tick_ns);
+	}
+}
+
+// a live node, copied out under pool_mutex
+struct mo_live_block {
+	uint64_t key;
+	size_t   size;
+};
+
+struct mo_live_walk {
+	struct mo_slab       * slab;
+	struct mo_live_block * out;			// the node walk
+	size_t                 nout;
+	size_t                 blocks;
+	size_t                 bytes;
+	unsigned               groups;
+	size_t                 lost_blocks;	// table full
+	size_t                 lost_bytes;
+};
+
+static void
+mo_live_add(struct mo_live_walk * w, uint64_t key, size_t size)
+{
+	struct mo_live * t = mo_ctx.live.table;
+	uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+	unsigned i, n;
+
+	w->blocks++;
+	w->bytes += size;
+	for (i = h >> 48, n = 0; n < MO_LIVE_SLOTS; i = (i + 1) % MO_LIVE_SLOTS, n++) {
+		if (!t[i].key) {
+			t[i].key = key;
+			w->groups++;
+		}
+		if (t[i].key == key) {
+			t[i].blocks++;
+			t[i].bytes += size;
+			return;
+		}
+	}
+	w->lost_blocks++;
+	w->lost_bytes += size;
+}
+
+// the nodes change under us, a block freed or allocated meanwhile may
+// or may not be counted. the block is only copied out, grouping waits
+// until pool_mutex is dropped.
+static void
+mo_live_node(void * e, void * arg)
+{
+	struct mo_live_walk * w = arg;
+	struct mo_rbnode * node = e;
+	struct mo_site * site;
+	uint64_t key;
+
+	if (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != MO_NODE_LIVE)
+		return;
+	site = node->user.info;
+	if (node->alloc_stack)
+		key = MO_LIVE_STACK | node->alloc_stack;
+	else if (site && site->caller)
+		key = site->caller;
+	else
+		key = MO_LIVE_UNKNOWN;
+	w->out[w->nout].key  = key;
+	w->out[w->nout].size = node->user.size;
+	w->nout++;
+}
+
+static void
+mo_live_slot(size_t idx, void * arg)
+{
+	struct mo_live_walk * w = arg;
+	struct mo_slab * slab = w->slab;
+	uint64_t key;
+
+	if (slab->stacks && slab->stacks[2*idx])
+		key = MO_LIVE_STACK | slab->stacks[2*idx];
+	else
+		key = MO_LIVE_SLAB | (slab->stride - MO_REDZONE);
+	mo_live_add(w, key, slab->user[idx]);
+}
+
+static void
+mo_live_print(const struct mo_live * g)
+{
+	const uintptr_t * pc = NULL;
+	uintptr_t where = 0;
+	unsigned n;
+	Dl_info info;
+	char what[64];
+
+	switch (g->key & MO_LIVE_UNKNOWN) {
+	case MO_LIVE_STACK:
+		pc = depot_get(g->key, &n);
+		snprintf(what, sizeof(what), "stack 0x%x", (unsigned)g->key);
+		if (pc)
+			where = pc[0];
+		break;
+	case MO_LIVE_SLAB:
+		snprintf(what, sizeof(what), "slab objects up to %u bytes", (unsigned)g->key);
+		break;
+	case MO_LIVE_UNKNOWN:
+		snprintf(what, sizeof(what), "unknown caller");
+		break;
+	default:
+		snprintf(what, sizeof(what), "caller");
+		where = g->key;
+	}
+	if (where && dladdr((void *)where, &info) && info.dli_fname)
+		fprintf(stderr, "mo: live %12zu bytes %10zu blocks  %s %p %s+0x%lx\n",
+				g->bytes, g->blocks, what, (void *)where, info.dli_fname,
+				(unsigned long)(where - (uintptr_t)info.dli_fbase));
+	else if (where)
+		fprintf(stderr, "mo: live %12zu bytes %10zu blocks  %s %p\n",
+				g->bytes, g->blocks, what, (void *)where);
+	else
+		fprintf(stderr, "mo: live %12zu bytes %10zu blocks  %s\n", g->bytes, g->blocks, what);
+}
+
+// rbnodes are found in the pool bitmap and slab objects in their slab's,
+// a word of 64 elements at a time, never through the page trees.
+// pool_mutex is held only while the live nodes are copied out, to a
+// buffer mapped for as many nodes as the pool has handed out. thread
+// cache refills wait that long, grouping and printing come after.
+static void
+mo_live_report(void)
+{
+	struct mo_live_walk w = { 0 };
+	struct mo_live top[MO_LIVE_TOP];
+	struct timespec t0, t1;
+	unsigned i, j, n = 0;
+	size_t k, used, cap = 0;
+	int rc;
+
+	if (!mo_ctx.live.table)
+		return;
+	rc = pthread_mutex_lock(&mo_ctx.live.mutex);
+	assert(rc == 0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	// the pool may grow while the buffer is mapped, then again
+	for (;;) {
+		rc = mo_mutex_lock(&mo_ctx.pool_mutex, MO_LAT_POOL_LOCK);
+		assert(rc == 0);
+		for (used=0, i=0; i<mo_ctx.pool.count; i++)
+			used += mo_ctx.pool.segs[i]->used;
+		if (used <= cap)
+			break;
+		rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+		assert(rc == 0);
+		if (w.out)
+			mo_syscall(munmap, w.out, cap * sizeof(*w.out));
+		cap = used + used / 8;
+		w.out = mo_syscall(mmap, NULL, cap * sizeof(*w.out), PROT_READ|PROT_WRITE,
+						   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (w.out == MAP_FAILED) {
+			fprintf(stderr, "mo: live heap: no room to copy %zu nodes\n", used);
+			rc = pthread_mutex_unlock(&mo_ctx.live.mutex);
+			assert(rc == 0);
+			return;
+		}
+	}
+	pool_chain_walk(&mo_ctx.pool, mo_live_node, &w);
+	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
+	assert(rc == 0);
+
+	for (k=0; k<w.nout; k++)
+		mo_live_add(&w, w.out[k].key, w.out[k].size);
+	if (w.out)
+		mo_syscall(munmap, w.out, cap * sizeof(*w.out));
+
+	for (i=1; i<=MO_SLAB_CLASSES; i++) {
+		struct mo_slab_class * sc = &mo_ctx.slabs[i];
+		rc = mo_mutex_lock(&sc->mutex, MO_LAT_CLASS_LOCK);
+		assert(rc == 0);
+		for (w.slab = sc->head; w.slab; w.slab = w.slab->next)
+			cbt_walk(&w.slab->cbt, mo_live_slot, &w);
+		rc = pthread_mutex_unlock(&sc->mutex);
+		assert(rc == 0);
+	}
+
+	// top groups by bytes, insertion into a short sorted list
+	for (i=0; i<MO_LIVE_SLOTS; i++) {
+		struct mo_live * g = &mo_ctx.live.table[i];
+		if (!g->key || (n == mo_ctx.live.top && g->bytes <= top[n-1].bytes))
+			continue;
+		if (n < mo_ctx.live.top)
+			n++;
+		for (j=n-1; j>0 && top[j-1].bytes < g->bytes; j--)
+			top[j] = top[j-1];
+		top[j] = *g;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "mo: live heap: %zu blocks, %zu bytes in %u groups, walked in %.1f ms\n",
+			w.blocks, w.bytes, w.groups,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	for (i=0; i<n; i++)
+		mo_live_print(&top[i]);
+	if (w.lost_blocks)
+		fprintf(stderr, "mo: live %12zu bytes %10zu blocks  in no group, the table is full\n",
+				w.lost_bytes, w.lost_blocks);
+
+	// zero again for the next report, and not resident meanwhile
+	madvise(mo_ctx.live.table, MO_LIVE_SLOTS * sizeof(struct mo_live), MADV_DONTNEED);
+	rc = pthread_mutex_unlock(&mo_ctx.live.mutex);
+	assert(rc == 0);
+}
+
+// a report takes locks, the handler only wakes the reporter thread
+static void
+mo_live_signal(int sig)
+{
+	(void)sig;
+	sem_post(&mo_ctx.live.wake);
+}
+
+static void *
+mo_live_reporter(void * arg)
+{
+	(void)arg;
+	for (;;) {
+		if (!sem_wait(&mo_ctx.live.wake))
+			mo_live_report();
+	}
+	return NULL;
+}
+
+__attribute__((constructor)) static void
+mo_live_start(void)
+{
+	struct sigaction sa = { .sa_handler = mo_live_signal, .sa_flags = SA_RESTART };
+	pthread_t th;
+
+	pthread_once(&mo_once, mo_init);
+	if (!mo_ctx.live.top)
+		return;
+	if (pthread_create(&th, NULL, mo_live_reporter, NULL)) {
+		fprintf(stderr, "mo: MO_HEAP_REPORT: no reporter thread, report at exit only\n");
+		return;
+	}
+	pthread_detach(th);
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+// written under a temporary name then renamed, a profile in the
+// directory is never half written
 static void
-mo_init(void)
+mo_prof_snapshot(void)
 {
-	unsigned order = 20;
-	char * env = getenv("MO_POOL_ORDER");
-	if (env) {
-		order = atoi(env);
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	unsigned long seq = __atomic_fetch_add(&mo_ctx.prof.seq, 1, __ATOMIC_RELAXED);
+	int fd, rc;
+
+	snprintf(path, sizeof(path), "%s/heap.%d.%04lu.pb", mo_ctx.prof.dir, (int)getpid(), seq);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "mo: MO_PROF: cannot open %s. errno=%d\n", tmp, errno);
+		return;
+	}
+	rc = prof_write(fd);
+	close(fd);
+	if (rc || rename(tmp, path)) {
+		fprintf(stderr, "mo: MO_PROF: cannot write %s. errno=%d\n", path, errno);
+		unlink(tmp);
 	}
-	if (order <= 0) order = 20;
+}
 
-	env = getenv("MO_REUSE_MEM");
-	if (env) {
-		mo_ctx.reuse_memory = atoi(env);
+// signals are left to the application's threads, and a deadline is
+// slept to so an early wake does not write early
+static void *
+mo_prof_writer(void * arg)
+{
+	struct timespec ts;
+	sigset_t all;
+
+	(void)arg;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (;;) {
+		ts.tv_sec += mo_ctx.prof.period;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		mo_prof_snapshot();
 	}
+	return NULL;
+}
+
+// the child has no writer, its samples are those of the parent
+static void
+mo_prof_atfork_child(void)
+{
+	prof_fork_child();
+	mo_ctx.prof.child = 1;
+}
 
-	mo_ctx.pool = pool_init(order, sizeof(struct mo_rbnode));
-	assert(mo_ctx.pool);
+// MO_PROF_PERIOD=0 writes the profile at exit only
+__attribute__((constructor)) static void
+mo_prof_start(void)
+{
+	pthread_t th;
 
-	sys_pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	pthread_once(&mo_once, mo_init);
+	if (!mo_ctx.prof.rate)
+		return;
+	pthread_atfork(prof_fork_prepare, prof_fork_parent, mo_prof_atfork_child);
+	if (!mo_ctx.prof.period)
+		return;
+	if (pthread_create(&th, NULL, mo_prof_writer, NULL)) {
+		fprintf(stderr, "mo: MO_PROF: no writer thread, profile at exit only\n");
+		return;
+	}
+	pthread_detach(th);
 }
 
-static struct mo_rbnode *
-mo_rbnode_alloc()
+__attribute__((destructor)) static void
+mo_report(void)
 {
-	int rc;
-	struct mo_rbnode * node;
-	rc = pthread_mutex_lock(&mo_ctx.pool_mutex);
-    assert(rc == 0);
-	node = pool_alloc(mo_ctx.pool);
-	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
-    assert(rc == 0);
+	unsigned i;
+	struct mo_stats st;
 
-	return node;
+	if (mo_ctx.latency)
+		mo_lat_report();
+	if (mo_ctx.stack_dump)
+		mo_stack_dump(mo_ctx.stack_dump);
+	if (mo_ctx.live.top)
+		mo_live_report();
+	if (mo_ctx.prof.rate && !mo_ctx.prof.child)
+		mo_prof_snapshot();
+	if (!mo_ctx.stats)
+		return;
+	mo_stats(&st);
+	fprintf(stderr, "mo: allocs: %lu mallocs, %lu frees, %zu live bytes, %zu peak bytes\n",
+			st.mallocs, st.frees, st.live_bytes, st.peak_bytes);
+	fprintf(stderr, "mo: span reuse: %lu hits, %lu misses, %.1f%% hit rate, %lu splits\n",
+			st.reuse_hits, st.reuse_misses,
+			st.reuse_hits + st.reuse_misses ?
+			100.0 * st.reuse_hits / (st.reuse_hits + st.reuse_misses) : 0.0, st.splits);
+	fprintf(stderr, "mo: quarantine: %zu spans, %zu resident bytes, %lu evicted\n",
+			st.cached_spans, st.cached_bytes, st.evicts);
+	fprintf(stderr, "mo: pool: %zu of %zu rbnodes in use, %u segments\n",
+			st.pool_used, st.pool_capacity, st.pool_segments);
+	fprintf(stderr, "mo: syscalls: %lu mmap, %lu mprotect, %lu munmap, %lu madvise, %lu mremap\n",
+			st.mmap, st.mprotect, st.munmap, st.madvise, st.mremap);
+	if (st.slabs)
+		fprintf(stderr, "mo: slabs: %zu slabs, %zu live objects\n", st.slabs, st.slab_objects);
+	for (i=0; mo_ctx.adapt.sites && i<MO_SITES; i++) {
+		struct mo_site * site = &mo_ctx.adapt.sites[i];
+		if (site->demoted)
+			fprintf(stderr, "mo: demoted site %p: %lu allocs, %lu bytes, %lu ticks\n",
+					(void *)site->caller, site->allocs, site->bytes, site->ticks);
+	}
 }
-static int
-mo_rbnode_free(struct mo_rbnode *node)
+
+// the slack of a span, before the user pointer and between the
+// user size and the guard page, is canary filled. an underflow or an
+// overrun too small to reach the guard page is caught on free.
+static inline void
+mo_span_slack_fill(struct mo_rbnode * node)
 {
-	int rc, r;
-	rc = pthread_mutex_lock(&mo_ctx.pool_mutex);
-    assert(rc == 0);
-	r = pool_free(mo_ctx.pool, node);
-    assert(r == 0);
-	rc = pthread_mutex_unlock(&mo_ctx.pool_mutex);
-    assert(rc == 0);
+	uintptr_t end = node->pages.ptr + mo_span_bytes(node);
+	canary_fill((void *)node->pages.ptr, node->user.ptr - node->pages.ptr, MO_CANARY);
+	canary_fill((void *)(node->user.ptr + node->user.size),
+				end - node->user.ptr - node->user.size, MO_CANARY);
+}
 
-	return r;
+static void
+mo_span_slack_check(struct mo_rbnode * node)
+{
+	void * ptr = (void *)node->user.ptr;
+	size_t size = node->user.size;
+	size_t head = node->user.ptr - node->pages.ptr;
+	size_t tail = node->pages.ptr + mo_span_bytes(node) - node->user.ptr - size;
+	size_t at;
+
+	at = canary_check((void *)node->pages.ptr, head, MO_CANARY);
+	if (at != head) {
+		mo_corrupt(ptr, size, (long)at - (long)head, "heap underflow", "free");
+		abort();
+	}
+	at = canary_check((char *)ptr + size, tail, MO_CANARY);
+	if (at != tail) {
+		mo_corrupt(ptr, size, size + at, "heap overflow", "free");
+		abort();
+	}
 }
 
-#define mo_rbnode_find(_tree, node, remove)							\
-	({																	\
-		int rc = 0;													\
-		struct mo_rbnode * r;											\
-		rc = pthread_mutex_lock(&mo_ctx._tree.mutex);					\
-		assert(rc == 0);												\
-		r = RB_FIND(mo_rbnode_##_tree, &mo_ctx._tree.tree, &node);		\
-		if (r && (remove))												\
-			RB_REMOVE(mo_rbnode_##_tree, &mo_ctx._tree.tree, r);		\
-		rc = pthread_mutex_unlock(&mo_ctx._tree.mutex);				\
-		assert(rc == 0);												\
-		r;																\
-	})
+// big mmap'ed spans keep the page offset of the user pointer, so the data
+// never moves in memory: pages are dropped off the end, or the span is
+// mremap'ed into a fresh reservation that already holds the guard page.
+// the gap left before the guard is less than a page and canary filled.
+static void *
+mo_span_remap(struct mo_rbnode * node, size_t size)
+{
+	size_t off = node->user.ptr - node->pages.ptr;
+	size_t pages = (off + size + sys_pagesize-1) / sys_pagesize;
+	size_t old = node->pages.num - 1;
 
-#define mo_rbnode_insert(_tree, node)									\
-	{																	\
-		int rc;														\
-		rc = pthread_mutex_lock(&mo_ctx._tree.mutex);					\
-		assert(rc == 0);												\
-		RB_INSERT(mo_rbnode_##_tree, &mo_ctx._tree.tree, node);		\
-		rc = pthread_mutex_unlock(&mo_ctx._tree.mutex);				\
-		assert(rc == 0);												\
+	if (pages < old) {
+		uintptr_t end = node->pages.ptr + pages*sys_pagesize;
+		if (mo_syscall(mprotect, (void *)end, sys_pagesize, PROT_NONE))
+			return NULL;
+		mo_map_set(end + sys_pagesize, old - pages, NULL);
+		mo_syscall(munmap, (void *)(end + sys_pagesize), (old - pages)*sys_pagesize);
+	} else if (pages > old) {
+#ifdef MREMAP_MAYMOVE
+		void * ptr = mo_syscall(mmap, NULL, (pages + 1)*sys_pagesize, PROT_NONE,
+								MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED)
+			return NULL;
+		// the old range is the kernel's once moved, its map entries go
+		// first, not over those of a span mapped there meanwhile
+		mo_map_set(node->pages.ptr, node->pages.num, NULL);
+		if (mo_syscall(mremap, (void *)node->pages.ptr, old*sys_pagesize, pages*sys_pagesize,
+					   MREMAP_MAYMOVE|MREMAP_FIXED, ptr) == MAP_FAILED) {
+			mo_map_set(node->pages.ptr, node->pages.num, node);
+			mo_syscall(munmap, ptr, (pages + 1)*sys_pagesize);
+			return NULL;
+		}
+		mo_syscall(munmap, (void *)(node->pages.ptr + old*sys_pagesize), sys_pagesize);
+		node->pages.ptr = (uintptr_t)ptr;
+		node->user.ptr  = (uintptr_t)ptr + off;
+		mo_map_set(node->pages.ptr, pages + 1, node);
+#else
+		return NULL;
+#endif
 	}
+	node->pages.num = pages + 1;
+	node->user.size = size;
+	canary_fill((void *)(node->user.ptr + size),
+				node->pages.ptr + mo_span_bytes(node) - node->user.ptr - size, MO_CANARY);
+	return (void *)node->user.ptr;
+}
 
+// resize a live span in place, NULL if it takes a new span and a copy.
+// a span of the same page count just slides the data to the guard.
 static void *
-mo_page_alloc(size_t pages)
+mo_span_resize(struct mo_rbnode * node, size_t size)
 {
-	int rc;
+	size_t size1 = (size + mo_ctx.align-1) & ~(mo_ctx.align-1);
+	size_t pages = (size1 + sys_pagesize-1) / sys_pagesize;
+	size_t old = node->pages.num - 1;
 	void * ptr;
-	ptr = mmap(NULL,
-			   (1+pages)*sys_pagesize,
-			   PROT_READ|PROT_WRITE,
-			   MAP_PRIVATE|MAP_ANONYMOUS,
-			   -1, //NOFD,
-			   0);
-	assert(ptr != MAP_FAILED);
-	if (ptr == MAP_FAILED) {
+
+	if (size <= mo_ctx.slab_max)
 		return NULL;
-	}
-	rc = mprotect(ptr+pages*sys_pagesize, sys_pagesize, PROT_NONE);
-	if (rc) {
-		fprintf(stderr, "mprotect failed. errno=%d \n", errno);
-		assert(0 && "mprotect failed");
-	}
-	assert(rc == 0);
+	if (!node->arena && old > mo_ctx.arena_pages && pages > mo_ctx.arena_pages)
+		return mo_span_remap(node, size);
+	if (pages != old)
+		return NULL;
+	ptr = (void *)(node->pages.ptr + pages*sys_pagesize - size1);
+	memmove(ptr, (void *)node->user.ptr, size < node->user.size ? size : node->user.size);
+	node->user.ptr  = (uintptr_t)ptr;
+	node->user.size = size;
+	mo_span_slack_fill(node);
 	return ptr;
 }
 
-static int
-mo_page_free(struct mo_rbnode * node)
+// the block is pushed against the guard page as far as align allows.
+// past a page the base of the span is not aligned enough, the span gets
+// room to slide the block down, and the gap before the guard grows.
+// zero the user block of a span with old data. big blocks get their
+// whole pages dropped, the kernel hands out zero pages on the next touch.
+#define MO_ZERO_MADVISE	(1024*1024)
+
+static void
+mo_span_zero(struct mo_rbnode * node)
 {
-	int rc;
-	assert(node);
-	rc = munmap((void *)node->pages.ptr, node->pages.num * sys_pagesize);
-	if (rc) {
-		fprintf(stderr, "munmap failed. errno=%d \n", errno);
+	uintptr_t ptr = node->user.ptr, end = ptr + node->user.size;
+	uintptr_t lo = (ptr + sys_pagesize-1) & ~(sys_pagesize-1);
+	uintptr_t hi = end & ~(sys_pagesize-1);
+
+	if (node->user.size >= MO_ZERO_MADVISE &&
+		!mo_syscall(madvise, (void *)lo, hi - lo, MADV_DONTNEED)) {
+		memset((void *)ptr, 0, lo - ptr);
+		memset((void *)hi, 0, end - hi);
+		return;
 	}
-	return rc;
+	canary_fill((void *)ptr, node->user.size, 0);
+}
+
+// heap profile sampling: every thread counts its allocated bytes down
+// to the next sample, see prof_next. the first countdown of a thread
+// is only drawn, nothing is sampled.
+static MO_TLS long     mo_prof_left;
+static MO_TLS uint64_t mo_prof_seed;
+
+static inline int
+mo_prof_due(size_t size)
+{
+	int first;
+
+	if (__builtin_expect(!mo_ctx.prof.rate, 1))
+		return 0;
+	if (__builtin_expect((mo_prof_left -= size) >= 0, 1))
+		return 0;
+	first = !mo_prof_seed;
+	mo_prof_left = prof_next(&mo_prof_seed);
+	return !first;
+}
+
+// the stack of a sample is kept whole, or as MO_STACKS already has it
+static int
+mo_prof_sample(void * ptr, size_t size, uint32_t stack)
+{
+	if (!stack)
+		stack = mo_stack_capture(DEPOT_FRAMES);
+	return prof_alloc(ptr, size, stack);
+}
+
+// the bit is cleared under the class lock on free, set here without it,
+// a word is shared with other slots
+static void
+mo_slab_sample(void * ptr, size_t size, uint32_t stack)
+{
+	struct mo_rbnode * node;
+	struct mo_slab * slab;
+	size_t idx;
+
+	if (!mo_prof_sample(ptr, size, stack))
+		return;
+	node = mo_rbnode_lookup(ptr);
+	slab = mo_slab_of(node);
+	idx = ((uintptr_t)ptr - slab->base) / slab->stride;
+	__atomic_fetch_or(&slab->sampled[idx / 64], 1ULL << idx % 64, __ATOMIC_RELAXED);
 }
 
 static void *
-mo_malloc(size_t size, const char * info)
+mo_memalign(size_t align, size_t size, const void * caller, int zero)
 {
 	int rc;
 	pthread_once(&mo_once, mo_init);
-	assert(mo_ctx.pool);
-	if (!mo_ctx.pool) {
+	uint64_t t0 = mo_op_ticks();
+	assert(mo_ctx.pool.count);
+	if (!mo_ctx.pool.count) {
 		return NULL;
 	}
-	// align to 4 bytes(int)
-	assert(size > 0);
-	size_t size1 = (size + 3) & ~3U;
-	size_t pages = (unsigned)(size1 + sys_pagesize-1) / sys_pagesize;
-	unsigned off = pages*sys_pagesize - size1;
+	assert(size > 0 && align && !(align & (align - 1)));
+	uint32_t stack = mo_stack();
+	if (size <= mo_ctx.slab_max && align <= 16) {
+		void * ptr = mo_slab_alloc(size, stack);
+		if (ptr) {
+			if (zero)
+				memset(ptr, 0, size);
+			if (mo_prof_due(size))
+				mo_slab_sample(ptr, size, stack);
+			mo_count(mallocs, 1);
+			mo_count_bytes(size);
+			if (mo_ctx.latency)
+				mo_lat_record(MO_LAT_MALLOC, mo_ticks() - t0);
+			return ptr;
+		}
+	}
+	size_t pages;
+	if (align <= sys_pagesize)
+		pages = (((size + align-1) & ~(align-1)) + sys_pagesize-1) / sys_pagesize;
+	else
+		pages = (size + align-1 + sys_pagesize-1) / sys_pagesize;
 
-	// try to alloc from pages_tree first.
-	struct mo_rbnode f = { .pages.num = pages + 1 };
-	struct mo_rbnode * node;
-	node = mo_rbnode_find(ptr_tree, f, 1);
+	// try to alloc from span cache first.
+	// fresh pages are zero, so are the ones of a madvised span
+	int clean = 1;
+	struct mo_rbnode * node = NULL;
+	if (mo_ctx.reuse_memory)
+		node = mo_span_get(pages + 1);
 	if (node) {
 		assert(node->pages.ptr && node->pages.num == (1 + pages));
+		clean = node->released;
 
-		rc = mprotect((void *)node->pages.ptr, pages*sys_pagesize, PROT_READ|PROT_WRITE);
+		if (node->arena)
+			rc = mo_arena_protect(node->arena, (void *)node->pages.ptr, 1);
+		else
+			rc = mo_syscall(mprotect, (void *)node->pages.ptr, pages*sys_pagesize, PROT_READ|PROT_WRITE);
 		if (rc) {
 			printf("error: failed in mprotect %d\n", errno);
 			exit(-1);
@@ -223,19 +3250,78 @@ mo_malloc(size_t size, const char * info)
 			assert(0 && "unable alloc rbnode");
 			return NULL;
 		}
-		void * ptr = mo_page_alloc(pages);
+		struct mo_arena * arena;
+		void * ptr = mo_page_alloc(pages, &arena);
 
+		node->arena      = arena;
 		node->pages.ptr  = (uintptr_t)ptr;
 		node->pages.num  = 1 + pages;
+		// a reused span is still in page map
+		mo_map_set(node->pages.ptr, node->pages.num, node);
 	}
-	node->user.info  = info;
+	struct mo_site * site = mo_site_get(caller);
+	node->released   = 0;
+	node->alloc_stack = stack;
+	node->free_stack = 0;
+	node->user.info  = site;
 	node->user.size  = size;
-	node->user.ptr   = (uintptr_t)node->pages.ptr + off;
-	mo_rbnode_insert(ptr_tree, node);
+	node->user.ptr   = (node->pages.ptr + pages*sys_pagesize - size) & ~(align - 1);
+	mo_span_slack_fill(node);
+	if (zero && !clean)
+		mo_span_zero(node);
+	node->sampled    = mo_prof_due(size) && mo_prof_sample((void *)node->user.ptr, size, stack);
+	__atomic_store_n(&node->state, MO_NODE_LIVE, __ATOMIC_RELEASE);
+
+	mo_count(mallocs, 1);
+	mo_count_bytes(size);
+	uint64_t t1 = mo_op_ticks();
+	mo_site_account(site, 1, size, node->pages.num*sys_pagesize, t1 - t0);
+	if (mo_ctx.latency)
+		mo_lat_record(MO_LAT_MALLOC, t1 - t0);
 
 	return (void *)node->user.ptr;
 }
 
+static void *
+mo_malloc(size_t size, const void * caller)
+{
+	return mo_memalign(mo_ctx.align, size, caller, 0);
+}
+
+static void *
+mo_calloc(size_t size, const void * caller)
+{
+	return mo_memalign(mo_ctx.align, size, caller, 1);
+}
+
+// the block grows to what its span holds anyway. the canary moves along,
+// a slab object gets its whole slot up to the redzone.
+static size_t
+mo_usable_size(void * ptr)
+{
+	struct mo_rbnode * node = mo_rbnode_lookup(ptr);
+	size_t size;
+
+	if (node && node->state == MO_NODE_SLAB) {
+		struct mo_slab * slab = mo_slab_of(node);
+		size_t idx = ((uintptr_t)ptr - slab->base) / slab->stride;
+		size_t old = mo_slab_size(slab, ptr);
+		if (!old)
+			return 0;
+		size = slab->stride - MO_REDZONE;
+		__atomic_store_n(&slab->user[idx], size, __ATOMIC_RELAXED);
+		mo_count_bytes((long)size - (long)old);
+		return size;
+	}
+	if (!node || node->user.ptr != (uintptr_t)ptr ||
+		__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != MO_NODE_LIVE)
+		return 0;
+	size = node->pages.ptr + mo_span_bytes(node) - node->user.ptr;
+	mo_count_bytes((long)size - (long)node->user.size);
+	node->user.size = size;
+	return size;
+}
+
 static void
 mo_free(void * ptr)
 {
@@ -243,78 +3329,350 @@ mo_free(void * ptr)
 	struct mo_rbnode * node;
 
 	pthread_once(&mo_once, mo_init);
-	assert(mo_ctx.pool);
-	if (!mo_ctx.pool) {
+	assert(mo_ctx.pool.count);
+	if (!mo_ctx.pool.count) {
 		return ;
 	}
-	// find & remove
-	struct mo_rbnode f = { .user.ptr = (uintptr_t)ptr };
-	node = mo_rbnode_find(ptr_tree, f, 1);
-	if (!node) {
+	uint64_t t0 = mo_op_ticks();
+	// find & mark it free, fails on double free
+	int live = MO_NODE_LIVE;
+	node = mo_rbnode_lookup(ptr);
+	if (node && node->state == MO_NODE_SLAB) {
+		mo_slab_free(mo_slab_of(node), ptr, mo_stack());
+		if (mo_ctx.latency)
+			mo_lat_record(MO_LAT_FREE, mo_ticks() - t0);
+		return;
+	}
+	if (!node || node->user.ptr != (uintptr_t)ptr ||
+		!__atomic_compare_exchange_n(&node->state, &live, MO_NODE_FREE, 0,
+									 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// a site that faulted is never demoted
+		if (node && node->user.info)
+			__atomic_add_fetch(&node->user.info->faults, 1, __ATOMIC_RELAXED);
 		assert(0 && "unable to find the ptr");
 		return;
 	}
+	mo_span_slack_check(node);
+	node->free_stack = mo_stack();
+	if (node->sampled) {
+		node->sampled = 0;
+		prof_free(ptr);
+	}
+	mo_count(frees, 1);
+	mo_count_bytes(-(long)node->user.size);
+	// the node is gone once back in the span cache
+	struct mo_site * site = node->user.info;
+	long held = node->pages.num*sys_pagesize;
 
 	if (mo_ctx.reuse_memory) {
 		// try to reuse pages.
-		// 1. insert node into pages tree
-		mo_rbnode_insert(page_tree, node);
-		// 2. change ptr to rw
-		rc = mprotect((void *)node->pages.ptr, (node->pages.num-1)*sys_pagesize, PROT_NONE);
+		// 0. the next owner reads the poison, not our data
+		if (mo_ctx.poison)
+			canary_fill((void *)node->user.ptr, node->user.size, MO_CANARY);
+		// 1. change ptr to none. guard markers drop the pages too.
+		if (node->arena) {
+			rc = mo_arena_protect(node->arena, (void *)node->pages.ptr, 0);
+			node->released = node->arena->markers;
+		} else
+			rc = mo_syscall(mprotect, (void *)node->pages.ptr, (node->pages.num-1)*sys_pagesize, PROT_NONE);
 		assert(rc ==0);
 		if (rc) {
 			printf("mprotect failed: errno %d\n", errno);
 			exit(-1);
 		}
-		// 3. keep node in pool
+		// 2. insert node into span cache, keep node in pool
+		mo_span_put(node);
 	} else {
-		rc = mo_page_free(node);
+		rc = mo_page_free(node, 0);
 		assert(rc == 0);
 
 		rc = mo_rbnode_free(node);
 		assert(rc == 0);
 	}
+	uint64_t t1 = mo_op_ticks();
+	mo_site_account(site, 0, 0, -held, t1 - t0);
+	if (mo_ctx.latency)
+		mo_lat_record(MO_LAT_FREE, t1 - t0);
+}
+
+// sampling: every thread counts down to its next guarded allocation,
+// the rest goes to the next allocator. the countdown is drawn uniformly
+// from [1, 2 * sample_rate - 1], so 1 in sample_rate is guarded on average.
+enum {
+	MO_ROUTE_NEXT = 0,
+	MO_ROUTE_GUARD,
+	MO_ROUTE_BOOT,
+};
+
+static MO_TLS long     mo_sample_countdown;
+static MO_TLS uint64_t mo_sample_seed;
+
+// a size compare, then a short binary search per configured list.
+static int
+mo_rules_match(size_t size, const void * caller)
+{
+	const struct mo_rules * rules = &mo_ctx.rules;
+	if (size < rules->min || size > rules->max)
+		return 0;
+	if (rules->allow.count && !mo_ranges_match(&rules->allow, (uintptr_t)caller))
+		return 0;
+	if (rules->deny.count && mo_ranges_match(&rules->deny, (uintptr_t)caller))
+		return 0;
+	return 1;
+}
+
+static inline int
+mo_site_demoted(const void * caller)
+{
+	struct mo_site * site = mo_site_get(caller);
+	return site && __atomic_load_n(&site->demoted, __ATOMIC_RELAXED);
+}
+
+// calls to the next sampled one, 1 without sampling
+static long
+mo_sample_draw(void)
+{
+	if (mo_ctx.sample_rate <= 1)
+		return 1;
+	// xorshift64
+	uint64_t x = mo_sample_seed;
+	if (!x)
+		x = (uintptr_t)&mo_sample_seed | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	mo_sample_seed = x;
+	return 1 + x % (2 * mo_ctx.sample_rate - 1);
+}
+
+// the rules are checked on sampled calls only, so an unsampled call
+// still costs just the countdown. a sampled call that misses them goes
+// to the next allocator and the next countdown is drawn all the same,
+// so every call has the same chance and eligible allocations are
+// guarded at the sample rate.
+static int
+mo_route_slow(size_t size, const void * caller)
+{
+	if (mo_boot.resolving)
+		return MO_ROUTE_BOOT;
+	pthread_once(&mo_once, mo_init);
+	mo_sample_countdown = mo_sample_draw();
+	if ((mo_ctx.rules.enabled && !mo_rules_match(size, caller)) ||
+		(mo_ctx.adapt.enabled && mo_site_demoted(caller)))
+		return MO_ROUTE_NEXT;
+	return MO_ROUTE_GUARD;
+}
+
+static inline int
+mo_route(size_t size, const void * caller)
+{
+	if (__builtin_expect(--mo_sample_countdown > 0, 1))
+		return MO_ROUTE_NEXT;
+	return mo_route_slow(size, caller);
+}
+
+// guarded by us or not, the page map knows.
+static inline int
+mo_owns(void * ptr)
+{
+	return mo_rbnode_lookup(ptr) != NULL;
+}
+
+static inline void *
+mo_alloc(size_t size, const void * caller)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	switch (mo_route(size, caller)) {
+	case MO_ROUTE_NEXT:
+		return mo_ctx.next.malloc(size);
+	case MO_ROUTE_BOOT:
+		return mo_boot_alloc(size);
+	}
+	return mo_malloc(size, caller);
+}
+
+static inline void *
+mo_alloc_aligned(size_t align, size_t size, const void * caller)
+{
+	void * ptr = NULL;
+	if (size == 0) {
+		return NULL;
+	}
+	switch (mo_route(size, caller)) {
+	case MO_ROUTE_NEXT:
+		// memalign and aligned_alloc take less than posix_memalign does
+		if (align < sizeof(void *))
+			align = sizeof(void *);
+		return mo_ctx.next.posix_memalign(&ptr, align, size) ? NULL : ptr;
+	case MO_ROUTE_BOOT:
+		return mo_boot_memalign(align, size);
+	}
+	return mo_memalign(align, size, caller, 0);
+}
+
+static inline void *
+mo_alloc_traced(size_t align, size_t size, const void * caller)
+{
+	void * ptr = mo_alloc_aligned(align, size, caller);
+	mo_trace(MO_TRACE_MEMALIGN, ptr, align, size, caller, 0);
+	return ptr;
 }
 
 void *
 malloc(size_t size){
-	if (size == 0) {
+	void * ptr = mo_alloc(size, __builtin_return_address(0));
+	mo_trace(MO_TRACE_MALLOC, ptr, 0, size, __builtin_return_address(0), 0);
+	return ptr;
+}
+
+int
+posix_memalign(void ** memptr, size_t align, size_t size)
+{
+	if (!align || (align & (align - 1)) || align % sizeof(void *)) {
+		return EINVAL;
+	}
+	*memptr = mo_alloc_traced(align, size, __builtin_return_address(0));
+	return *memptr || !size ? 0 : ENOMEM;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	if (!align || (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return mo_alloc_traced(align, size, __builtin_return_address(0));
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	if (!align || (align & (align - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return mo_alloc_traced(align, size, __builtin_return_address(0));
+}
+
+void *
+valloc(size_t size)
+{
+	return mo_alloc_traced(sysconf(_SC_PAGESIZE), size, __builtin_return_address(0));
+}
+
+void *
+pvalloc(size_t size)
+{
+	size_t ps = sysconf(_SC_PAGESIZE);
+	// a page at least, like glibc
+	if (size > SIZE_MAX - ps) {
+		errno = ENOMEM;
 		return NULL;
 	}
-	return mo_malloc(size, NULL);
+	size = size ? (size + ps-1) & ~(ps-1) : ps;
+	return mo_alloc_traced(ps, size, __builtin_return_address(0));
+}
+
+size_t
+malloc_usable_size(void * ptr)
+{
+	if (!ptr || mo_boot_owns(ptr)) {
+		return 0;
+	}
+	if (!mo_owns(ptr)) {
+		pthread_once(&mo_once, mo_init);
+		return mo_ctx.next.malloc_usable_size(ptr);
+	}
+	return mo_usable_size(ptr);
 }
 
 void
 free(void *ptr) {
-	if (!ptr) {
+	if (!ptr || mo_boot_owns(ptr)) {
 		return ;
 	}
-	return mo_free(ptr);
+	uint64_t seq = mo_trace_begin();
+	if (!mo_owns(ptr)) {
+		pthread_once(&mo_once, mo_init);
+		mo_ctx.next.free(ptr);
+	} else {
+		mo_free(ptr);
+	}
+	mo_trace(MO_TRACE_FREE, ptr, 0, 0, __builtin_return_address(0), seq);
+}
+
+static inline void *
+mo_calloc_route(size_t size, size_t n, const void * caller)
+{
+	size_t total;
+	if (__builtin_mul_overflow(size, n, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (total == 0) {
+		return NULL;
+	}
+	switch (mo_route(total, caller)) {
+	case MO_ROUTE_NEXT:
+		return mo_ctx.next.calloc(size, n);
+	case MO_ROUTE_BOOT:
+		// the boot buffer is never reused, still zero
+		return mo_boot_alloc(total);
+	}
+	return mo_calloc(total, caller);
 }
 
 void *
 calloc(size_t size, size_t n)
 {
-	void * ptr = mo_malloc(size*n, NULL);
+	void * ptr = mo_calloc_route(size, n, __builtin_return_address(0));
+	mo_trace(MO_TRACE_CALLOC, ptr, 0, size * n, __builtin_return_address(0), 0);
 	return ptr;
 }
 
-void *
-realloc(void *p, size_t const nbytes)
+// p is ours and live
+static void *
+mo_realloc(void * p, size_t nbytes, const void * caller)
 {
-	if (!p) {
-		return mo_malloc(nbytes, NULL);
+	size_t size_cpy;
+	struct mo_rbnode * node;
+
+	// a free, as glibc does it
+	if (!nbytes) {
+		mo_free(p);
+		return NULL;
 	}
-	struct mo_rbnode f = { .user.ptr = (uintptr_t)p };
-	struct mo_rbnode * node = mo_rbnode_find(ptr_tree, f, 0);
-	if (!node) {
+	node = mo_rbnode_lookup(p);
+	if (node && node->state == MO_NODE_SLAB) {
+		size_cpy = mo_slab_size(mo_slab_of(node), p);
+		if (!size_cpy)
+			return NULL;
+	} else if (!node || node->user.ptr != (uintptr_t)p ||
+		__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != MO_NODE_LIVE) {
 		return NULL;
+	} else {
+		size_t held = node->pages.num*sys_pagesize, size = node->user.size;
+		uint64_t t0 = mo_op_ticks();
+		void * ptr = mo_span_resize(node, nbytes);
+		if (ptr) {
+			// sampled again as a new block
+			if (node->sampled)
+				prof_free(p);
+			node->sampled = mo_prof_due(nbytes) && mo_prof_sample(ptr, nbytes, 0);
+			mo_count_bytes((long)nbytes - (long)size);
+			mo_site_account(node->user.info, 0, 0,
+							(long)(node->pages.num*sys_pagesize) - (long)held, mo_op_ticks() - t0);
+			return ptr;
+		}
+		size_cpy = node->user.size;
 	}
-	void * ptr = mo_malloc(nbytes, NULL);
+	void * ptr = mo_malloc(nbytes, caller);
 	if (!ptr) {
 		return NULL;
 	}
-	size_t size_cpy = node->user.size;
 	if (size_cpy > nbytes)
 		size_cpy = nbytes;
 
@@ -324,57 +3682,113 @@ realloc(void *p, size_t const nbytes)
 	return ptr;
 }
 
+static inline void *
+mo_realloc_route(void *p, size_t const nbytes, const void * caller)
+{
+	if (!p) {
+		return mo_alloc(nbytes, caller);
+	}
+	if (mo_boot_owns(p)) {
+		// boot buffer never shrinks, copy what may be there
+		void * ptr = mo_alloc(nbytes, caller);
+		size_t size_cpy = mo_boot.buf + sizeof(mo_boot.buf) - (char *)p;
+		if (ptr)
+			memcpy(ptr, p, size_cpy < nbytes ? size_cpy : nbytes);
+		return ptr;
+	}
+	if (!mo_owns(p)) {
+		pthread_once(&mo_once, mo_init);
+		return mo_ctx.next.realloc(p, nbytes);
+	}
+	uint64_t t0 = mo_lat_start();
+	void * ptr = mo_realloc(p, nbytes, caller);
+	mo_lat_end(MO_LAT_REALLOC, t0);
+	return ptr;
+}
+
+void *
+realloc(void *p, size_t const nbytes)
+{
+	uint64_t seq = mo_trace_begin();
+	void * ptr = mo_realloc_route(p, nbytes, __builtin_return_address(0));
+	mo_trace(MO_TRACE_REALLOC, ptr, (uintptr_t)p, nbytes, __builtin_return_address(0), seq);
+	return ptr;
+}
 
 #ifdef MALLOC_TEST
 
-int main() {
-	size_t i, size, NUM= 500000; //100000;
-	char ** ptr;
-	ptr = (char **)mo_malloc(sizeof(char *)*NUM, __FUNCTION__);
-	assert(ptr);
-
-	for (i=0; i<NUM; i++) {
-		size = i+1;
-		ptr[i] = (char *)mo_malloc(size, __FUNCTION__);
-		//memset(ptr[i], 0, size);
-		ptr[i][0] = 0;
-		ptr[i][size-1] = 0;
-		mo_free(ptr[i]);
-		ptr[i] = NULL;
-	}
-	printf("mo: passed basic test\n");
-
-	unsigned loop = 32;
-	while(loop--) {
-		for (i=0; i<NUM; i++) {
-			size = 1 + random() % 1024*1024*2; // <= 2M
-			ptr[i] = (char *)mo_malloc(size, __FUNCTION__);
-			assert(ptr[i]);
-			if (ptr[i]) {
-				ptr[i][0] = 0;
-				ptr[i][size-1] = 0;
-			}
-		#if 1
-			int k = random() % (i+1);
-			if (ptr[k]) {
-				mo_free(ptr[k]);
-				ptr[k] = NULL;
-			}
-		#else
-			mo_free(ptr[i]);
-			ptr[i] = NULL;
-		#endif
-		}
-		for (i=0; i<NUM; i++) {
-			if (ptr[i]) {
-				mo_free(ptr[i]);
-				ptr[i] = NULL;
-			}
-		}
-		printf("mo: stress test %d is done\n", loop);
+// madvised spans lead the age list, the others add up to the shard bytes
+static void
+mo_span_check(struct mo_page_shard * s)
+{
+	struct mo_rbnode * node;
+	size_t bytes = 0;
+	int fresh = 0;
+
+	for (node=s->age.head; node; node=node->age_entry.next) {
+		if (node == s->fresh)
+			fresh = 1;
+		assert(fresh == !node->released);
+		if (!node->released)
+			bytes += mo_span_bytes(node);
+	}
+	assert(bytes == s->bytes && bytes <= mo_ctx.quarantine_bytes);
+}
+
+// the rest of a split madvised span goes back madvised, the budget
+// must not count it again.
+static void
+mo_split_evict_test(void)
+{
+	struct mo_page_shard * s = &mo_ctx.page_tree[0];
+	struct mo_stats st0, st;
+	void * p;
+
+	mo_stats(&st0);
+	mo_free(mo_malloc(100 * sys_pagesize, NULL));
+	mo_free(mo_malloc(10 * sys_pagesize, NULL));
+	mo_span_check(s);
+	p = mo_malloc(20 * sys_pagesize, NULL);
+	mo_span_check(s);
+	mo_free(mo_malloc(60 * sys_pagesize, NULL));
+	mo_span_check(s);
+	mo_free(p);
+	mo_span_check(s);
+	// the 100, 10 and 60 page spans, once each
+	mo_stats(&st);
+	assert(st.madvise - st0.madvise == 3);
+	printf("mo: passed split evict test\n");
+}
+
+// realloc to 0 frees the block
+static void
+mo_realloc_zero_test(void)
+{
+	struct mo_stats st0, st;
+	void * p = mo_malloc(100, NULL);
+
+	mo_stats(&st0);
+	assert(mo_realloc(p, 0, NULL) == NULL);
+	mo_stats(&st);
+	assert(st.frees == st0.frees + 1 && !mo_usable_size(p));
+	printf("mo: passed realloc zero test\n");
+}
+
+int main(int argc, char ** argv)
+{
+	char buf[32];
 
+	// one shard with a 50 page budget, mo_init reads it once
+	if (!getenv("MO_TREE_SHARDS")) {
+		snprintf(buf, sizeof(buf), "%ld", 50 * sysconf(_SC_PAGESIZE));
+		setenv("MO_TREE_SHARDS", "1", 1);
+		setenv("MO_QUARANTINE_BYTES", buf, 1);
+		execv("/proc/self/exe", argv);
+		return 1;
 	}
-	printf("mo: passed stress test\n");
+	(void)argc;
+	mo_split_evict_test();
+	mo_realloc_zero_test();
 	return 0;
 }
 #endif
@@ -0,0 +1,45 @@
+#ifndef __MOZART_H
+#define __MOZART_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mo_stats {
+	unsigned long mallocs;			// guarded allocations
+	unsigned long frees;
+	size_t        live_bytes;		// requested bytes of live blocks
+	size_t        peak_bytes;
+	unsigned long mmap;
+	unsigned long mprotect;
+	unsigned long munmap;
+	unsigned long madvise;
+	unsigned long mremap;
+	unsigned long reuse_hits;		// spans taken from the span cache
+	unsigned long reuse_misses;
+	unsigned long splits;
+	unsigned long evicts;
+	size_t        cached_spans;		// span cache, all shards
+	size_t        cached_bytes;		// resident part of it
+	size_t        pool_used;		// rbnodes, thread caches included
+	size_t        pool_capacity;
+	unsigned      pool_segments;
+	size_t        slabs;
+	size_t        slab_objects;
+};
+
+// sum of the per-thread counters and a look at the pool, span cache
+// and slabs. takes the locks briefly, do not call from a signal handler.
+void mo_stats(struct mo_stats * st);
+
+// verify the redzones of every live slab object.
+// each broken one is reported on stderr, returns how many.
+int mo_check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,164 +4,265 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "pool.h"
 
 /* TODO */
 #define log_error(...)
 
-/* TODO */
-#ifdef CBT_ENABLE
-static int
-cbt_alloc(struct cbt * cbt)
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	0
+#endif
+
+// element memory is committed / decommitted in chunks of this size
+#define POOL_COMMIT_CHUNK	(256 * 1024)
+
+#define CBT_WORD_BITS	64
+#define CBT_WORDS(n)	(((n) + CBT_WORD_BITS - 1) / CBT_WORD_BITS)
+
+// words of every level, leaf level first.
+static unsigned
+cbt_levels(size_t count, size_t words[CBT_MAX_DEPTH])
 {
-	int total = 1 << cbt->order;
-	assert(cbt->nodes[0] <= total);
+	unsigned depth = 0;
+	do {
+		assert(depth < CBT_MAX_DEPTH);
+		count = CBT_WORDS(count);
+		words[depth++] = count;
+	} while (count > 1);
+	return depth;
+}
 
-	if (cbt->nodes[0] == total)
-		return -1;
-	unsigned len = 1;
-	unsigned * node = cbt->nodes;
-	for(int i=1; i<order; i++) {
-		node[0] ++;
-		if (node[len] < total) {
-			node += len; 
-		} else {
-			assert(node[len+1] < total);
-			node += len + 1;
-		}
-		len = len * 2;
-	}
-	return node - (cbt->nodes + total);
+size_t
+cbt_bytes(size_t count)
+{
+	size_t words[CBT_MAX_DEPTH], bytes = 0;
+	unsigned i, depth = cbt_levels(count, words);
+	for (i=0; i<depth; i++)
+		bytes += words[i] * sizeof(uint64_t);
+	return bytes;
 }
 
-static int
-cbt_free(struct cbt * cbt, int idx)
+// tail bits have nothing below them, mark them full
+static void
+cbt_mark_tail(struct cbt * cbt)
 {
-	int total = 1 << cbt->order;
-	assert(cbt->nodes[0] <= total);
+	unsigned l;
+	size_t bits = cbt->count;
+	for (l=cbt->depth; l-- > 0; ) {
+		size_t n = CBT_WORDS(bits);
+		if (bits % CBT_WORD_BITS)
+			cbt->nodes[l][n-1] |= ~0ULL << (bits % CBT_WORD_BITS);
+		bits = n;
+	}
+}
 
-	if (cbt->nodes[0] == total)
-		return -1;
+// memory layout: root level first, leaf level last.
+// mem must be zeroed, so a fresh mapping is not touched beyond the tails.
+void
+cbt_init(struct cbt * cbt, void * mem, size_t count)
+{
+	size_t words[CBT_MAX_DEPTH];
+	unsigned i, depth = cbt_levels(count, words);
+	uint64_t * p = mem;
+
+	cbt->depth = depth;
+	cbt->count = count;
+	for (i=0; i<depth; i++) {
+		cbt->nodes[i] = p;
+		p += words[depth-1-i];
+	}
+	cbt_mark_tail(cbt);
+}
 
-	unsigned len = total;
-	unsigned * node = cbt->nodes;
-	for(int i=order-1; i >= 0; i--) {
-		node[0] --;
-		len = len / 2;
-		node -= idx/2;
+void
+cbt_reset(struct cbt * cbt)
+{
+	unsigned l;
+	size_t bits = cbt->count;
+	for (l=cbt->depth; l-- > 0; ) {
+		size_t n = CBT_WORDS(bits);
+		memset(cbt->nodes[l], 0, n * sizeof(uint64_t));
+		bits = n;
 	}
-	return node - (cbt->nodes + total);
+	cbt_mark_tail(cbt);
 }
 
-#endif
+// every set leaf, a word at a time with ctz. an empty word costs a load.
+size_t
+cbt_walk(struct cbt * cbt, void (*fn)(size_t, void *), void * arg)
+{
+	uint64_t * leaf = cbt->nodes[cbt->depth - 1];
+	size_t w, idx, n = 0;
+
+	for (w=0; w<CBT_WORDS(cbt->count); w++) {
+		uint64_t bits = leaf[w];
+		while (bits) {
+			idx = w * CBT_WORD_BITS + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			// tail bits are marked taken, see cbt_mark_tail
+			if (idx >= cbt->count)
+				break;
+			fn(idx, arg);
+			n++;
+		}
+	}
+	return n;
+}
 
-static unsigned
-_pool_alloc(struct pool * pool)
+// no leaf bit set in [lo, hi)
+int
+cbt_empty(struct cbt * cbt, size_t lo, size_t hi)
 {
-	unsigned * p = pool->bit_array;
-	unsigned i, n = pool->ecount >> 5;
+	uint64_t * leaf = cbt->nodes[cbt->depth - 1];
+	size_t w = lo / CBT_WORD_BITS, last = (hi - 1) / CBT_WORD_BITS;
+	uint64_t m = ~0ULL << (lo % CBT_WORD_BITS);
+
+	if (lo >= hi)
+		return 1;
+	for (; w < last; w++, m = ~0ULL) {
+		if (leaf[w] & m)
+			return 0;
+	}
+	if (hi % CBT_WORD_BITS)
+		m &= ~(~0ULL << (hi % CBT_WORD_BITS));
+	return !(leaf[w] & m);
+}
 
-	if (pool->used == pool->ecount)
-		return -1U;
+// lowest free leaf: find-first-zero at each level, depth loads.
+size_t
+cbt_alloc(struct cbt * cbt)
+{
+	unsigned l;
+	size_t idx = 0, i;
+	uint64_t * w;
 
-	for (i=0; i<n; i++) {
-		if (p[0] != ~0U)
-			break;
-		p ++;
+	if (cbt->nodes[0][0] == ~0ULL)
+		return -1;
+	for (l=0; l<cbt->depth; l++) {
+		assert(cbt->nodes[l][idx] != ~0ULL);
+		idx = idx * CBT_WORD_BITS + __builtin_ctzll(~cbt->nodes[l][idx]);
 	}
-	assert(*p != ~0U);
-	n = i;
-	for (i=0; i<32; i++) {
-		if (!(p[0] & (1U<<i)))
+	assert(idx < cbt->count);
+
+	// mark it and propagate fullness upwards.
+	for (i=idx, l=cbt->depth; l-- > 0; i /= CBT_WORD_BITS) {
+		w = &cbt->nodes[l][i / CBT_WORD_BITS];
+		*w |= 1ULL << (i % CBT_WORD_BITS);
+		if (*w != ~0ULL)
 			break;
 	}
-	assert(!(p[0] & (1U<<i)));
-	p[0] |= (1U << i);
-	pool->used ++;
-
-	unsigned idx = (n << 5) + i;
-	assert(pool->bit_array[idx/32] & (1U << i));
 	return idx;
 }
 
-static int
-_pool_free(struct pool * pool, unsigned idx)
+int
+cbt_free(struct cbt * cbt, size_t idx)
 {
-	assert(idx < pool->ecount);
-	unsigned   x1 = idx / 32;
-	unsigned   x2 = idx % 32;
-	unsigned * p = &pool->bit_array[x1];
+	unsigned l = cbt->depth - 1;
+	uint64_t * w = &cbt->nodes[l][idx / CBT_WORD_BITS];
+	uint64_t   m = 1ULL << (idx % CBT_WORD_BITS);
 
-	if (!(p[0] & (1U << x2))) {
-		assert(0 && "invalid index in _pool_free");
+	if (idx >= cbt->count || !(*w & m)) {
+		assert(0 && "invalid index in cbt_free");
 		return -1;
 	}
-	assert(p[0] & (1U << x2));
-	p[0] &= ~(1U << x2);
-	pool->used --;
+	for (;;) {
+		int full = (*w == ~0ULL);
+		*w &= ~m;
+		// parent bit only tracks fullness
+		if (!full || l == 0)
+			break;
+		idx /= CBT_WORD_BITS;
+		l --;
+		w = &cbt->nodes[l][idx / CBT_WORD_BITS];
+		m = 1ULL << (idx % CBT_WORD_BITS);
+	}
 	return 0;
 }
 
+// give the tail of the element memory back to the OS.
+// a chunk is decommitted once it and the chunk below it are both idle,
+// so alloc/free at a chunk boundary does not madvise every time.
+static void
+pool_trim(struct pool * pool)
+{
+	size_t chunk = POOL_COMMIT_CHUNK;
+	while (pool->commit >= 2 * chunk) {
+		size_t lo = (pool->commit - 2 * chunk) / pool->esize;
+		size_t hi = (pool->commit + pool->esize - 1) / pool->esize;
+		if (hi > pool->ecount)
+			hi = pool->ecount;
+		if (!cbt_empty(&pool->cbt, lo, hi))
+			break;
+		pool->commit -= chunk;
+#ifdef MADV_DONTNEED
+		madvise(pool->element + pool->commit, chunk, MADV_DONTNEED);
+#endif
+	}
+}
 
 void
 pool_reset(struct pool * pool)
 {
 	pool->used = 0;
-	memset(&pool->bit_array[0], 0, sizeof(unsigned)*pool->ecount/32);
+	cbt_reset(&pool->cbt);
+#ifdef MADV_DONTNEED
+	if (pool->commit)
+		madvise(pool->element, pool->commit, MADV_DONTNEED);
+#endif
+	pool->commit = 0;
 }
 
 // memory layout
-// k = order - 5
 // 1. struct pool
-// 2. complete binary tree: 4 * (2^(k+1) -1)
-// 3. 32 bits mask array: 4 * (2^k)
-// 4. memory (element_size * 2^order)
+// 2. complete binary tree: cbt_bytes(2^order), root level first
+// 3. leaf level of cbt is the bits array: 8 * 2^(order-6)
+// 4. memory (element_size * 2^order), page aligned
+//
+// the whole range is reserved with MAP_NORESERVE. element pages are
+// committed by first touch, and pool_alloc hands out the lowest free
+// element, so the resident part grows only as far as allocation reaches.
+// pool->commit tracks that high water mark for pool_trim.
 //
 struct pool *
 pool_init  (unsigned order, unsigned esize)
 {
 	if (order < 5)
 		order = 5;
-	int k = order - 5;
+	if (order > POOL_MAX_ORDER)
+		return NULL;
 	esize = (esize + 3U) & ~3U;
 
-#ifdef CBT_ENABLE
-	unsigned cbt_off   = sizeof(struct pool);
-	unsigned cbt_size  = sizeof(unsigned) * ((1<<(k+1)) -1);
-#else
-	unsigned cbt_off   = sizeof(struct pool);
-	unsigned cbt_size  = 0;
-#endif	
-	unsigned bits_off  = cbt_off + cbt_size;
-	unsigned bits_size = sizeof(unsigned) * (1U<<k);
-	unsigned elem_off   = bits_off + bits_size;
-	
-	size_t bytes = sizeof(struct pool) +
-		cbt_size + bits_size +  esize * (1 << order);
-		
+	size_t pagesize  = (size_t)sysconf(_SC_PAGESIZE);
+	size_t ecount    = (size_t)1 << order;
+	size_t cbt_off   = sizeof(struct pool);
+	size_t cbt_size  = cbt_bytes(ecount);
+	size_t elem_off  = (cbt_off + cbt_size + pagesize - 1) & ~(pagesize - 1);
+
+	size_t bytes = (elem_off + (size_t)esize * ecount + pagesize - 1) & ~(pagesize - 1);
+
 	void * ptr = mmap(NULL,
 					  bytes,
 					  PROT_READ|PROT_WRITE,
-					  MAP_PRIVATE|MAP_ANONYMOUS,
+					  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
 					  -1,
 					  0);
-	assert(ptr);
 	if (ptr == MAP_FAILED) {
 		assert(0 && "mmap failed");
-		log_error("mmap failed. order: %u , element size: %u, total bytes: %u \n",
+		log_error("mmap failed. order: %u , element size: %u, total bytes: %zu \n",
 				  order, esize, bytes);
 		return NULL;
 	}
 	struct pool * pool = ptr;
 	pool->size		= bytes;
 	pool->esize		= esize;
-	pool->ecount	= 1U << order;
-	pool->bit_array = ptr + bits_off;
+	pool->ecount	= ecount;
+	pool->used		= 0;
+	pool->commit	= 0;
 	pool->element	= ptr + elem_off;
-	pool->cbt.order	= k;
-	pool->cbt.nodes	= ptr + cbt_off;
+	cbt_init(&pool->cbt, ptr + cbt_off, pool->ecount);
+	pool->bit_array = pool->cbt.nodes[pool->cbt.depth - 1];
 
-	pool_reset(pool);
 	return pool;
 }
 
@@ -175,15 +276,19 @@ pool_fini (struct pool * pool)
 void *
 pool_alloc(struct pool *pool)
 {
-#ifdef CBT_ENABLE	
-	unsigned idx = cbt_alloc(&pool->cbt);
-#else
-	unsigned idx = _pool_alloc(pool);
-#endif	
-	if (idx == -1U) { // failed.
+	size_t idx = cbt_alloc(&pool->cbt);
+	if (idx == (size_t)-1) { // failed.
 		log_error("Failed in pool_alloc. too many allocations. try to increase pool size.\n");
 		return NULL;
 	}
+	pool->used ++;
+
+	size_t end = (idx + 1) * pool->esize;
+	if (end > pool->commit) {
+		size_t max = (void *)pool + pool->size - pool->element;
+		end = (end + POOL_COMMIT_CHUNK - 1) & ~(size_t)(POOL_COMMIT_CHUNK - 1);
+		pool->commit = end < max ? end : max;
+	}
 	return pool->element + idx * pool->esize;
 }
 
@@ -196,17 +301,174 @@ pool_free(struct pool *pool, void * e)
 		log_error("Failed in pool_free. \n");
 		return -1;
 	}		
-	unsigned idx = (e - pool->element) / pool->esize;
-	assert(idx >=0 && idx < pool->ecount);
+	size_t idx = (e - pool->element) / pool->esize;
+	assert(idx < pool->ecount);
+
+	if (cbt_free(&pool->cbt, idx))
+		return -1;
+	pool->used --;
+
+	// freeing in the top two chunks
+	if (pool->commit >= 2 * POOL_COMMIT_CHUNK &&
+		(idx + 1) * pool->esize > pool->commit - 2 * POOL_COMMIT_CHUNK)
+		pool_trim(pool);
+	return 0;
+}
+
+struct pool_walk {
+	struct pool * pool;
+	void (*fn)(void *, void *);
+	void * arg;
+};
+
+static void
+pool_walk_one(size_t idx, void * arg)
+{
+	struct pool_walk * w = arg;
+	w->fn(w->pool->element + idx * w->pool->esize, w->arg);
+}
+
+size_t
+pool_walk(struct pool * pool, void (*fn)(void *, void *), void * arg)
+{
+	struct pool_walk w = { pool, fn, arg };
+	return cbt_walk(&pool->cbt, pool_walk_one, &w);
+}
+
+static int
+pool_chain_insert(struct pool_chain * chain, struct pool * pool)
+{
+	unsigned i;
+	if (chain->count == POOL_CHAIN_MAX)
+		return -1;
+	for (i=chain->count; i>0 && chain->segs[i-1] > pool; i--)
+		chain->segs[i] = chain->segs[i-1];
+	chain->segs[i] = pool;
+	chain->count ++;
+	return 0;
+}
+
+static void
+pool_chain_remove(struct pool_chain * chain, struct pool * pool)
+{
+	unsigned i;
+	for (i=0; i<chain->count && chain->segs[i] != pool; i++)
+		;
+	assert(i < chain->count);
+	chain->count --;
+	for (; i<chain->count; i++)
+		chain->segs[i] = chain->segs[i+1];
+	if (chain->hint == pool)
+		chain->hint = chain->first;
+}
+
+int
+pool_chain_init(struct pool_chain * chain, unsigned order, unsigned esize)
+{
+	memset(chain, 0, sizeof(*chain));
+	chain->order = order;
+	chain->esize = esize;
+	chain->first = pool_init(order, esize);
+	if (!chain->first)
+		return -1;
+	chain->hint = chain->first;
+	return pool_chain_insert(chain, chain->first);
+}
+
+void
+pool_chain_fini(struct pool_chain * chain)
+{
+	while (chain->count)
+		pool_fini(chain->segs[--chain->count]);
+	chain->first = chain->hint = NULL;
+}
+
+// segment owning e: binary search on segment address.
+struct pool *
+pool_chain_owner(struct pool_chain * chain, void * e)
+{
+	unsigned lo = 0, hi = chain->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if ((void *)chain->segs[mid] <= e)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	struct pool * pool = chain->segs[lo-1];
+	if (e < pool->element ||
+		e >= (pool->element + pool->ecount * pool->esize))
+		return NULL;
+	return pool;
+}
+
+size_t
+pool_chain_walk(struct pool_chain * chain, void (*fn)(void *, void *), void * arg)
+{
+	size_t n = 0;
+	unsigned i;
+
+	for (i=0; i<chain->count; i++)
+		n += pool_walk(chain->segs[i], fn, arg);
+	return n;
+}
 
-#ifdef CBT_ENABLE
-	int cbt_idx = idx / 32;
-	cbt_free(cbt_idx);
+void *
+pool_chain_alloc(struct pool_chain * chain)
+{
+	unsigned i;
+	struct pool * pool = chain->hint;
+
+	if (!pool || pool->used == pool->ecount) {
+		pool = NULL;
+		for (i=0; i<chain->count; i++) {
+			if (chain->segs[i]->used < chain->segs[i]->ecount) {
+				pool = chain->segs[i];
+				break;
+			}
+		}
+	}
+	if (!pool) {
+		// grow
+		pool = pool_init(chain->order + chain->count, chain->esize);
+		if (!pool)
+			return NULL;
+		if (pool_chain_insert(chain, pool)) {
+			log_error("Failed in pool_chain_alloc. too many segments.\n");
+			pool_fini(pool);
+			return NULL;
+		}
+	}
+	chain->hint = pool;
+	return pool_alloc(pool);
+}
 
-	pool->bit_array[cbt_idx] &= ~(1<< (idx % 32));
-#else
-	return _pool_free(pool, idx);
-#endif	
+int
+pool_chain_free(struct pool_chain * chain, void * e)
+{
+	unsigned i;
+	struct pool * pool = pool_chain_owner(chain, e);
+	if (!pool) {
+		assert(0 && "pool_chain_free: element not in chain");
+		return -1;
+	}
+	if (pool_free(pool, e))
+		return -1;
+	if (pool->used || pool == chain->first)
+		return 0;
+
+	// keep one empty segment around, release the others.
+	for (i=0; i<chain->count; i++) {
+		struct pool * p = chain->segs[i];
+		if (p != pool && p != chain->first && !p->used) {
+			pool_chain_remove(chain, pool);
+			pool_fini(pool);
+			break;
+		}
+	}
+	return 0;
 }
 
 #ifdef POOL_TEST
@@ -290,10 +552,163 @@ pool_test()
 }
 
 
+static void
+pool_chain_test_walk(void * e, void * arg)
+{
+	*(unsigned *)arg += *(unsigned *)e;
+}
+
+static void
+pool_chain_test()
+{
+	unsigned i, n = 5000;
+	struct pool_chain chain;
+	void ** ptr = malloc(sizeof(void **)*n);
+
+	int rc = pool_chain_init(&chain, 5, 16);
+	assert(rc == 0);
+	for (i=0; i<n; i++) {
+		ptr[i] = pool_chain_alloc(&chain);
+		assert(ptr[i]);
+		*(unsigned *)ptr[i] = i;
+	}
+	assert(chain.count > 1);
+	for (i=0; i<n; i++) {
+		struct pool * pool = pool_chain_owner(&chain, ptr[i]);
+		assert(pool && *(unsigned *)ptr[i] == i);
+	}
+	// the walk sees every other one once they are freed, in order
+	for (i=0; i<n; i+=2) {
+		rc = pool_chain_free(&chain, ptr[i]);
+		assert(rc == 0);
+	}
+	unsigned sum = 0;
+	assert(pool_chain_walk(&chain, pool_chain_test_walk, &sum) == n / 2);
+	for (i=1; i<n; i+=2)
+		sum -= i;
+	assert(sum == 0);
+	for (i=1; i<n; i+=2) {
+		rc = pool_chain_free(&chain, ptr[i]);
+		assert(rc == 0);
+	}
+	assert(pool_chain_walk(&chain, pool_chain_test_walk, &sum) == 0);
+	// first segment plus one spare
+	assert(chain.count <= 2);
+	assert(chain.first->used == 0);
+	pool_chain_fini(&chain);
+	free(ptr);
+	printf("pool: test : passed chain test\n");
+}
+
+static void
+pool_commit_test()
+{
+	size_t i, n = 100000;
+	// ~120 GB of address space, only what is used gets committed
+	struct pool * pool = pool_init(30, 112);
+	assert(pool && pool->ecount == (size_t)1 << 30);
+	void ** ptr = malloc(sizeof(void **)*n);
+
+	for (i=0; i<n; i++) {
+		ptr[i] = pool_alloc(pool);
+		memset(ptr[i], 0xa5, 112);
+	}
+	assert(pool->commit >= n * 112 && pool->commit < n * 112 + (1U << 20));
+	for (i=n; i>0; i--)
+		pool_free(pool, ptr[i-1]);
+	assert(pool->used == 0);
+	// one idle chunk stays committed
+	assert(pool->commit <= POOL_COMMIT_CHUNK);
+	pool_fini(pool);
+	free(ptr);
+	printf("pool: test : passed commit test\n");
+}
+
 int main(){
 	pool_test();
+	pool_chain_test();
+	pool_commit_test();
 
 	return 0;
 }
 
 #endif
+
+#ifdef POOL_BENCH
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+static double
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// alloc/free cost at a given occupancy.
+// live elements are kept in random order, each round frees a batch of
+// them (random holes) and allocates the same number back, so the fill
+// level stays constant.
+int main(int argc, char ** argv)
+{
+	unsigned order = argc > 1 ? atoi(argv[1]) : 20;
+	unsigned fills[] = { 0, 10, 25, 50, 75, 90, 95, 99 };
+	size_t i, j, k, n, live, pos, batch, ops = 1U << 22;
+	struct pool * pool = pool_init(order, 64);
+	assert(pool);
+	n = pool->ecount;
+	void ** ptr = malloc(sizeof(void *) * n);
+
+	printf("pool: order %u, %zu elements\n", order, n);
+	for (k=0; k<sizeof(fills)/sizeof(fills[0]); k++) {
+		pool_reset(pool);
+		for (i=0; i<n; i++)
+			ptr[i] = pool_alloc(pool);
+		for (i=n; i>0; i--) {
+			size_t r = random() % i;
+			void * t = ptr[r];
+			ptr[r] = ptr[i-1];
+			ptr[i-1] = t;
+		}
+		// free random elements down to the fill level
+		live = n * fills[k] / 100;
+		if (live == n)
+			live --;
+		for (i=live; i<n; i++)
+			pool_free(pool, ptr[i]);
+
+		// an empty pool just frees what it allocated
+		batch = live ? (live < 1024 ? live : 1024) : 1024;
+		double ta = 0, tf = 0, t0;
+		for (i=0, pos=0; i<ops; i+=batch) {
+			if (pos + batch > (live ? live : batch))
+				pos = 0;
+			if (live) {
+				t0 = now_ns();
+				for (j=0; j<batch; j++)
+					pool_free(pool, ptr[pos+j]);
+				tf += now_ns() - t0;
+			}
+			t0 = now_ns();
+			for (j=0; j<batch; j++)
+				ptr[pos+j] = pool_alloc(pool);
+			ta += now_ns() - t0;
+			if (!live) {
+				t0 = now_ns();
+				for (j=0; j<batch; j++)
+					pool_free(pool, ptr[pos+j]);
+				tf += now_ns() - t0;
+			}
+			pos += batch;
+		}
+		assert(pool->used == live);
+		printf("pool: fill %3u%% : alloc %5.1f ns, free %5.1f ns\n",
+			   fills[k], ta / ops, tf / ops);
+	}
+	pool_fini(pool);
+	free(ptr);
+	return 0;
+}
+#endif
@@ -1,25 +1,75 @@
 #ifndef __ALLOCATOR_FIX_H
 #define __ALLOCATOR_FIX_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define CBT_MAX_DEPTH	8
+
 // complete binary tree
+// hierarchical occupancy bitmap, 64 ways per level.
+// nodes[depth-1] is the leaf level, one bit per element.
+// a bit of level l is set once the word it covers in level l+1 is full.
+// nodes[0] is a single root word.
 struct cbt {
-	int order;
-	int * nodes;  
+	unsigned   depth;
+	size_t     count;    // leaf bits
+	uint64_t * nodes[CBT_MAX_DEPTH];
 };
 
+size_t cbt_bytes (size_t count);
+void   cbt_init  (struct cbt *, void * mem, size_t count);
+void   cbt_reset (struct cbt *);
+size_t cbt_alloc (struct cbt *);
+int    cbt_free  (struct cbt *, size_t idx);
+int    cbt_empty (struct cbt *, size_t lo, size_t hi);
+// calls fn on every set leaf, in order, and returns how many.
+size_t cbt_walk  (struct cbt *, void (*fn)(size_t idx, void *arg), void *arg);
+
+#define POOL_MAX_ORDER	40
+
 struct pool {
-	unsigned   size;     // total memory in bytes
+	size_t     size;     // total memory in bytes
 	unsigned   esize;    // one element size in bytes
-	unsigned   ecount;   // element count. 2^(k+5)
-	unsigned * bit_array;// bits
+	size_t     ecount;   // element count. 2^order
+	uint64_t * bit_array;// bits, leaf level of cbt
 	void     * element;   // element
-	unsigned   used;     // remove it once CBT is enabled.
+	size_t     used;     // allocated elements
+	size_t     commit;   // element bytes possibly resident, chunk aligned
 	struct cbt cbt;
 };
 
 struct pool * pool_init  (unsigned order, unsigned esize);
 void   pool_fini  (struct pool *);
+void   pool_reset (struct pool *);
 void * pool_alloc (struct pool *);
 int    pool_free  (struct pool *, void *ptr);
 
+// calls fn on every allocated element, in address order, and returns
+// how many. the pool must not change meanwhile.
+size_t pool_walk  (struct pool *, void (*fn)(void *e, void *arg), void *arg);
+
+#define POOL_CHAIN_MAX	32
+
+// growable pool, a chain of pool segments.
+// segment n is created with order + n, so the capacity about doubles
+// on every grow. segs are kept sorted by address for owner lookup.
+// an empty segment (other than the first one) is given back to the OS
+// once a second empty segment shows up.
+struct pool_chain {
+	unsigned      order;    // order of the first segment
+	unsigned      esize;
+	unsigned      count;    // segments in segs
+	struct pool * first;    // never released
+	struct pool * hint;     // last segment allocated from
+	struct pool * segs[POOL_CHAIN_MAX];
+};
+
+int    pool_chain_init  (struct pool_chain *, unsigned order, unsigned esize);
+void   pool_chain_fini  (struct pool_chain *);
+void * pool_chain_alloc (struct pool_chain *);
+int    pool_chain_free  (struct pool_chain *, void *ptr);
+struct pool * pool_chain_owner (struct pool_chain *, void *ptr);
+size_t pool_chain_walk  (struct pool_chain *, void (*fn)(void *e, void *arg), void *arg);
+
 #endif
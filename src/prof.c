@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "prof.h"
+#include "depot.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE	0
+#endif
+
+// live samples by address, open addressing with backward shift on
+// remove. at the default rate a full table stands for 32 GiB of heap.
+#define PROF_SLOTS		(1 << 16)
+// a profile's stacks and frames, sized like the samples
+#define PROF_GROUPS		PROF_SLOTS
+#define PROF_LOCS		(1 << 16)
+#define PROF_MAPS		1024
+// slots copied out per hold of prof.mutex while summing
+#define PROF_CHUNK		1024
+
+#define PROF_LN2		0.6931471805599453
+
+struct prof_sample {
+	uintptr_t ptr;			// 0 for a free slot
+	size_t    size;
+	uint32_t  stack;
+};
+
+struct prof_group {
+	uint32_t  stack;
+	int       used;
+	double    count;		// estimates, samples scaled up
+	double    bytes;
+};
+
+struct prof_loc {
+	uintptr_t pc;			// 0 for a free slot
+	uint64_t  id;
+};
+
+struct prof_map {
+	uintptr_t lo, hi;
+};
+
+static struct {
+	size_t               rate;
+	pthread_mutex_t      mutex;		// the samples
+	struct prof_sample * samples;
+	unsigned             live;
+	unsigned long        dropped;
+
+	pthread_mutex_t      out_mutex;	// the rest is the writer's
+	struct prof_group  * groups;
+	struct prof_loc    * locs;
+	uint64_t             nlocs;
+	struct prof_map      maps[PROF_MAPS];
+	unsigned             nmaps;
+	uint64_t             nstrings;
+} prof = {
+	.mutex     = PTHREAD_MUTEX_INITIALIZER,
+	.out_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *
+prof_map(size_t size)
+{
+	void * p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+					MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int
+prof_init(size_t rate)
+{
+	prof.samples = prof_map(PROF_SLOTS * sizeof(struct prof_sample));
+	prof.groups = prof_map(PROF_GROUPS * sizeof(struct prof_group));
+	prof.locs = prof_map(PROF_LOCS * sizeof(struct prof_loc));
+	if (!prof.samples || !prof.groups || !prof.locs)
+		return -1;
+	prof.rate = rate ? rate : 1;
+	return 0;
+}
+
+// -ln u for u in (0, 1]. u = 2^e m with m in [1, 2), and
+// ln m = 2 atanh((m-1)/(m+1)), the series is within 1e-6 there.
+// libm is not pulled in for that.
+static double
+prof_neglog(double u)
+{
+	union { double d; uint64_t i; } v = { u };
+	int e = (int)(v.i >> 52) - 1023;
+	v.i = (v.i & ((1ULL << 52) - 1)) | (1023ULL << 52);
+	double t = (v.d - 1) / (v.d + 1), t2 = t * t;
+	double ln = 2 * t * (1 + t2 * (1./3 + t2 * (1./5 + t2 * (1./7 + t2 * (1./9 + t2 / 11)))));
+	return -(e * PROF_LN2 + ln);
+}
+
+// e^-x for x >= 0, as 2^-k e^-r with r in [0, ln 2)
+static double
+prof_expneg(double x)
+{
+	union { double d; uint64_t i; } s;
+	unsigned i, k;
+	double r, t = 1, e = 1;
+
+	if (x > 700)
+		return 0;
+	k = x / PROF_LN2;
+	r = x - k * PROF_LN2;
+	for (i=1; i<=10; i++) {
+		t *= -r / i;
+		e += t;
+	}
+	s.i = (uint64_t)(1023 - k) << 52;
+	return e * s.d;
+}
+
+long
+prof_next(uint64_t * seed)
+{
+	// xorshift64
+	uint64_t x = *seed;
+	if (!x)
+		x = (uintptr_t)seed | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*seed = x;
+	double u = ((x >> 11) + 1) * (1.0 / (1ULL << 53));
+	return (long)(prof_neglog(u) * prof.rate) + 1;
+}
+
+static unsigned
+prof_slot(uintptr_t ptr)
+{
+	uint64_t h = ptr * 0x9E3779B97F4A7C15ULL;
+	return h >> 48;
+}
+
+int
+prof_alloc(void * ptr, size_t size, uint32_t stack)
+{
+	unsigned i;
+	int rc, ok = 0;
+
+	rc = pthread_mutex_lock(&prof.mutex);
+	assert(rc == 0);
+	if (prof.live < PROF_SLOTS - 1) {
+		for (i = prof_slot((uintptr_t)ptr); prof.samples[i].ptr; i = (i + 1) % PROF_SLOTS)
+			;
+		prof.samples[i].ptr = (uintptr_t)ptr;
+		prof.samples[i].size = size;
+		prof.samples[i].stack = stack;
+		prof.live++;
+		ok = 1;
+	} else {
+		prof.dropped++;
+	}
+	rc = pthread_mutex_unlock(&prof.mutex);
+	assert(rc == 0);
+	return ok;
+}
+
+void
+prof_free(void * ptr)
+{
+	struct prof_sample * t = prof.samples;
+	unsigned i, j, k;
+	int rc;
+
+	rc = pthread_mutex_lock(&prof.mutex);
+	assert(rc == 0);
+	for (i = prof_slot((uintptr_t)ptr); t[i].ptr; i = (i + 1) % PROF_SLOTS) {
+		if (t[i].ptr == (uintptr_t)ptr)
+			break;
+	}
+	if (t[i].ptr) {
+		prof.live--;
+		// move up every later entry of the run that may go in the hole
+		for (j = i;;) {
+			t[i].ptr = 0;
+			do {
+				j = (j + 1) % PROF_SLOTS;
+				if (!t[j].ptr)
+					goto done;
+				k = prof_slot(t[j].ptr);
+			} while (i <= j ? i < k && k <= j : i < k || k <= j);
+			t[i] = t[j];
+			i = j;
+		}
+	}
+done:
+	rc = pthread_mutex_unlock(&prof.mutex);
+	assert(rc == 0);
+}
+
+struct prof_total {
+	unsigned groups;
+	double   count;
+	double   bytes;
+};
+
+// a block of size s was sampled with probability 1 - e^(-s/rate),
+// it stands for 1 / that many blocks
+static void
+prof_sum_one(struct prof_total * total, const struct prof_sample * s)
+{
+	double scale = 1 / (1 - prof_expneg((double)s->size / prof.rate));
+	unsigned j;
+
+	for (j = s->stack * 0x9E3779B1U >> 16; ; j = (j + 1) % PROF_GROUPS) {
+		struct prof_group * g = &prof.groups[j];
+		if (!g->used) {
+			g->used = 1;
+			g->stack = s->stack;
+			total->groups++;
+		}
+		if (g->stack == s->stack) {
+			g->count += scale;
+			g->bytes += scale * s->size;
+			break;
+		}
+	}
+	total->count += scale;
+	total->bytes += scale * s->size;
+}
+
+// samples by stack into prof.groups. the table is copied out a chunk at
+// a time, sampled mallocs and frees only wait for one chunk. a sample
+// moved by a remove meanwhile may be missed, or counted twice.
+static void
+prof_sum(struct prof_total * total)
+{
+	struct prof_sample chunk[PROF_CHUNK];
+	unsigned i, k, n;
+	int rc;
+
+	memset(total, 0, sizeof(*total));
+	for (k=0; k<PROF_SLOTS; k+=PROF_CHUNK) {
+		rc = pthread_mutex_lock(&prof.mutex);
+		assert(rc == 0);
+		for (i=k, n=0; i<k+PROF_CHUNK; i++) {
+			if (prof.samples[i].ptr)
+				chunk[n++] = prof.samples[i];
+		}
+		rc = pthread_mutex_unlock(&prof.mutex);
+		assert(rc == 0);
+		for (i=0; i<n; i++)
+			prof_sum_one(total, &chunk[i]);
+	}
+}
+
+// protobuf, as much of it as profile.proto needs: varints and
+// length delimited fields. a message is built in a buffer of its own,
+// then written out behind its length.
+struct prof_msg {
+	size_t len;
+	char   buf[1024];
+};
+
+static void
+pb_varint(struct prof_msg * m, uint64_t v)
+{
+	while (v >= 0x80 && m->len < sizeof(m->buf)) {
+		m->buf[m->len++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	if (m->len < sizeof(m->buf))
+		m->buf[m->len++] = (char)v;
+}
+
+static void
+pb_uint(struct prof_msg * m, unsigned field, uint64_t v)
+{
+	pb_varint(m, field << 3);
+	pb_varint(m, v);
+}
+
+static void
+pb_bytes(struct prof_msg * m, unsigned field, const void * p, size_t n)
+{
+	pb_varint(m, field << 3 | 2);
+	pb_varint(m, n);
+	if (n > sizeof(m->buf) - m->len)
+		n = sizeof(m->buf) - m->len;
+	memcpy(m->buf + m->len, p, n);
+	m->len += n;
+}
+
+struct prof_out {
+	int    fd;
+	int    err;
+	size_t len;
+	char   buf[8192];
+};
+
+static void
+prof_flush(struct prof_out * o)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < o->len && !o->err) {
+		n = write(o->fd, o->buf + done, o->len - done);
+		if (n > 0)
+			done += n;
+		else if (n < 0 && errno != EINTR)
+			o->err = 1;
+	}
+	o->len = 0;
+}
+
+static void
+prof_puts(struct prof_out * o, const void * p, size_t len)
+{
+	const char * s = p;
+	while (len) {
+		size_t n = sizeof(o->buf) - o->len;
+		if (n > len)
+			n = len;
+		memcpy(o->buf + o->len, s, n);
+		o->len += n;
+		s += n;
+		len -= n;
+		if (o->len == sizeof(o->buf))
+			prof_flush(o);
+	}
+}
+
+// a top level field of the profile
+static void
+prof_emit(struct prof_out * o, unsigned field, const void * p, size_t n)
+{
+	struct prof_msg hdr = { 0 };
+
+	pb_varint(&hdr, field << 3 | 2);
+	pb_varint(&hdr, n);
+	prof_puts(o, hdr.buf, hdr.len);
+	prof_puts(o, p, n);
+}
+
+// the index of a string is its place in the string table
+static uint64_t
+prof_string(struct prof_out * o, const char * s)
+{
+	prof_emit(o, 6, s, strlen(s));
+	return prof.nstrings++;
+}
+
+static void
+prof_value_type(struct prof_out * o, unsigned field, uint64_t type, uint64_t unit)
+{
+	struct prof_msg m = { 0 };
+
+	pb_uint(&m, 1, type);
+	pb_uint(&m, 2, unit);
+	prof_emit(o, field, m.buf, m.len);
+}
+
+// one mapping per executable mapping of a file, for pprof to find the
+// binaries. a line of /proc/self/maps:
+//   lo-hi perms offset dev inode path
+static void
+prof_mapping(struct prof_out * o, char * line)
+{
+	struct prof_msg m = { 0 };
+	uintptr_t lo, hi, off;
+	char * p = line, * perms;
+
+	lo = strtoul(p, &p, 16);
+	if (*p++ != '-')
+		return;
+	hi = strtoul(p, &p, 16);
+	perms = ++p;
+	if (strlen(perms) < 5 || perms[2] != 'x' || prof.nmaps == PROF_MAPS)
+		return;
+	off = strtoul(perms + 5, &p, 16);
+	if (!(p = strchr(p + 1, ' ')))
+		return;
+	strtoul(p, &p, 10);
+	while (*p == ' ')
+		p++;
+	if (*p != '/')
+		return;
+
+	prof.maps[prof.nmaps].lo = lo;
+	prof.maps[prof.nmaps].hi = hi;
+	pb_uint(&m, 1, ++prof.nmaps);
+	pb_uint(&m, 2, lo);
+	pb_uint(&m, 3, hi);
+	pb_uint(&m, 4, off);
+	pb_uint(&m, 5, prof_string(o, p));
+	prof_emit(o, 3, m.buf, m.len);
+}
+
+static void
+prof_mappings(struct prof_out * o)
+{
+	char buf[4096], line[4096 + 256];
+	size_t len = 0;
+	ssize_t n, i;
+	int fd;
+
+	prof.nmaps = 0;
+	fd = open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i=0; i<n; i++) {
+			if (buf[i] != '\n') {
+				if (len < sizeof(line) - 1)
+					line[len++] = buf[i];
+				continue;
+			}
+			line[len] = 0;
+			prof_mapping(o, line);
+			len = 0;
+		}
+	}
+	close(fd);
+}
+
+// location id of a return address, written out on first use. the
+// address is the one of the call, pprof symbolizes it to the call line.
+static uint64_t
+prof_location(struct prof_out * o, uintptr_t pc)
+{
+	struct prof_msg m = { 0 };
+	struct prof_loc * l = NULL;
+	unsigned i, n;
+	uint64_t id;
+
+	for (i = prof_slot(pc), n = 0; n < PROF_LOCS; i = (i + 1) % PROF_LOCS, n++) {
+		l = &prof.locs[i];
+		if (l->pc == pc)
+			return l->id;
+		if (!l->pc)
+			break;
+	}
+	id = ++prof.nlocs;
+	if (n < PROF_LOCS) {
+		l->pc = pc;
+		l->id = id;
+	}
+	pb_uint(&m, 1, id);
+	for (i=0; i<prof.nmaps; i++) {
+		if (pc >= prof.maps[i].lo && pc < prof.maps[i].hi) {
+			pb_uint(&m, 2, i + 1);
+			break;
+		}
+	}
+	pb_uint(&m, 3, pc - 1);
+	prof_emit(o, 4, m.buf, m.len);
+	return id;
+}
+
+static void
+prof_sample(struct prof_out * o, const struct prof_group * g)
+{
+	struct prof_msg ids = { 0 }, values = { 0 }, m = { 0 };
+	const uintptr_t * pc;
+	unsigned i, n = 0;
+
+	pc = depot_get(g->stack, &n);
+	for (i=0; pc && i<n; i++)
+		pb_varint(&ids, prof_location(o, pc[i]));
+	pb_varint(&values, (uint64_t)(g->count + 0.5));
+	pb_varint(&values, (uint64_t)(g->bytes + 0.5));
+	pb_bytes(&m, 1, ids.buf, ids.len);
+	pb_bytes(&m, 2, values.buf, values.len);
+	prof_emit(o, 2, m.buf, m.len);
+}
+
+// fields of profile.proto: 1 sample_type, 2 sample, 3 mapping,
+// 4 location, 6 string_table, 9 time_nanos, 11 period_type, 12 period
+int
+prof_write(int fd)
+{
+	struct prof_out o = { .fd = fd };
+	struct prof_msg m = { 0 };
+	struct prof_total total;
+	struct timespec ts;
+	unsigned i;
+	int rc;
+
+	if (!prof.samples)
+		return -1;
+	rc = pthread_mutex_lock(&prof.out_mutex);
+	assert(rc == 0);
+	prof_sum(&total);
+
+	prof.nstrings = 0;
+	prof_string(&o, "");
+	uint64_t objects = prof_string(&o, "inuse_objects");
+	uint64_t count = prof_string(&o, "count");
+	uint64_t space = prof_string(&o, "inuse_space");
+	uint64_t bytes = prof_string(&o, "bytes");
+	prof_value_type(&o, 1, objects, count);
+	prof_value_type(&o, 1, space, bytes);
+	prof_value_type(&o, 11, prof_string(&o, "space"), bytes);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pb_uint(&m, 9, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	pb_uint(&m, 12, prof.rate);
+	prof_puts(&o, m.buf, m.len);
+
+	prof_mappings(&o);
+	prof.nlocs = 0;
+	for (i=0; i<PROF_GROUPS; i++) {
+		if (prof.groups[i].used)
+			prof_sample(&o, &prof.groups[i]);
+	}
+	prof_flush(&o);
+
+	// zero again for the next profile, and not resident meanwhile
+	madvise(prof.groups, PROF_GROUPS * sizeof(struct prof_group), MADV_DONTNEED);
+	madvise(prof.locs, PROF_LOCS * sizeof(struct prof_loc), MADV_DONTNEED);
+	rc = pthread_mutex_unlock(&prof.out_mutex);
+	assert(rc == 0);
+	return o.err ? -1 : 0;
+}
+
+// writer lock first, as prof_write takes them
+void
+prof_fork_prepare(void)
+{
+	int rc = pthread_mutex_lock(&prof.out_mutex);
+	assert(rc == 0);
+	rc = pthread_mutex_lock(&prof.mutex);
+	assert(rc == 0);
+}
+
+void
+prof_fork_parent(void)
+{
+	int rc = pthread_mutex_unlock(&prof.mutex);
+	assert(rc == 0);
+	rc = pthread_mutex_unlock(&prof.out_mutex);
+	assert(rc == 0);
+}
+
+void
+prof_fork_child(void)
+{
+	int rc = pthread_mutex_init(&prof.mutex, NULL);
+	assert(rc == 0);
+	rc = pthread_mutex_init(&prof.out_mutex, NULL);
+	assert(rc == 0);
+}
+
+#ifdef PROF_TEST
+#include <stdio.h>
+
+int main()
+{
+	static uintptr_t blocks[1 << 20];
+	struct prof_total total;
+	uint64_t seed = 0;
+	long left = 0;
+	size_t i, n = sizeof(blocks) / sizeof(blocks[0]), size = 100;
+	uintptr_t pc[DEPOT_FRAMES];
+	uint32_t stack;
+
+	assert(prof_init(4096) == 0 && depot_init() == 0);
+	assert(prof_neglog(1) == 0);
+	assert(prof_neglog(0.5) > 0.693 && prof_neglog(0.5) < 0.694);
+	assert(prof_expneg(0) == 1);
+	assert(prof_expneg(10) > 4.539e-5 && prof_expneg(10) < 4.540e-5);
+	stack = depot_put(pc, depot_capture(pc, DEPOT_FRAMES));
+
+	// 100 MB in 100 byte blocks, the estimate is within a few percent
+	for (i=0; i<n; i++) {
+		uintptr_t ptr = (i + 1) * 128;
+		blocks[i] = 0;
+		if ((left -= size) >= 0)
+			continue;
+		left = prof_next(&seed);
+		if (prof_alloc((void *)ptr, size, stack))
+			blocks[i] = ptr;
+	}
+	prof_sum(&total);
+	printf("prof: %.0f blocks, %.0f bytes estimated, of %zu and %zu\n",
+		   total.count, total.bytes, n, n * size);
+	assert(total.groups == 1);
+	assert(total.bytes > 0.95 * n * size && total.bytes < 1.05 * n * size);
+	memset(prof.groups, 0, PROF_GROUPS * sizeof(struct prof_group));
+
+	int fd = open("/dev/null", O_WRONLY);
+	assert(prof_write(fd) == 0);
+	close(fd);
+
+	// every sample freed, in no particular order
+	for (i=0; i<n; i+=2)
+		if (blocks[i])
+			prof_free((void *)blocks[i]);
+	for (i=1; i<n; i+=2)
+		if (blocks[i])
+			prof_free((void *)blocks[i]);
+	assert(prof.live == 0);
+	for (i=0; i<PROF_SLOTS; i++)
+		assert(!prof.samples[i].ptr);
+	printf("prof test ok\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef __PROF_H
+#define __PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// sampled heap profile. an allocation is sampled once every rate bytes
+// on average, the distance between two samples is drawn from an
+// exponential distribution so every byte has the same chance. the
+// sampled blocks still live can be written out as a pprof profile.
+// nothing here calls malloc, the tables are mapped by prof_init.
+#define PROF_RATE		(512 << 10)
+
+// reserve the tables, -1 if that fails.
+int      prof_init (size_t rate);
+
+// bytes to allocate until the next sample. seed is the caller's, per
+// thread, it is seeded on the first call when 0.
+long     prof_next (uint64_t * seed);
+
+// a sampled block, stack is a depot id. 0 when the table is full and
+// the sample is dropped.
+int      prof_alloc(void * ptr, size_t size, uint32_t stack);
+
+// the block was sampled and is now freed
+void     prof_free (void * ptr);
+
+// the live samples as an uncompressed profile.proto, samples scaled to
+// estimates of the whole heap. one writer at a time, the others wait.
+int      prof_write(int fd);
+
+// pthread_atfork handlers: the locks are taken before a fork, dropped
+// in the parent after it, made anew in the child.
+void     prof_fork_prepare(void);
+void     prof_fork_parent (void);
+void     prof_fork_child  (void);
+
+#endif
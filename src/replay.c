@@ -0,0 +1,453 @@
+// replay a MO_TRACE file against whatever malloc this process has.
+//
+//   replay [-l lib] [-f] trace
+//
+// every traced thread gets a thread of its own. by default the calls are
+// made in the order of the trace, one at a time across all threads. with
+// -f a thread only waits for the blocks it frees to exist, the threads
+// run as fast as they can. -l preloads lib, libmozart.so say, without it
+// the replay runs on glibc or whatever LD_PRELOAD gives.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mozart.h"
+#include "trace.h"
+
+#define REPLAY_NONE		UINT32_MAX
+#define REPLAY_PENDING	((void *)-1)
+#define REPLAY_SPIN		64
+
+struct replay_thread {
+	pthread_t          th;
+	uint32_t           tid;
+	size_t             count;
+	size_t           * rank;		// its events, in trace order
+};
+
+// address -> id of the live block, open addressing. addr 0 is an empty
+// slot and 1 a deleted one, no block lives there.
+struct replay_slot {
+	uint64_t           addr;
+	uint32_t           id;
+};
+
+static struct {
+	struct mo_trace_event * ev;	// sorted by seq
+	size_t             n;
+	uint32_t         * id;		// block obtained by event i, or REPLAY_NONE
+	uint32_t         * old;		// block released by it
+	void * volatile  * ptrs;	// by id, what the replay got
+	uint32_t           ids;
+	size_t             skipped;	// frees of blocks from before the trace
+	struct replay_thread * threads;
+	unsigned           nthreads;
+	int                fast;
+	size_t             turn;		// next event to run, in order mode
+} replay;
+
+static struct replay_slot * replay_map;
+static size_t replay_mask;
+
+static void *
+replay_alloc(size_t size)
+{
+	void * p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("replay: mmap");
+		exit(1);
+	}
+	return p;
+}
+
+static struct replay_slot *
+replay_find(uint64_t addr, int insert)
+{
+	uint64_t h = addr * 0x9e3779b97f4a7c15ULL;
+	size_t i = (h ^ h >> 32) & replay_mask;
+	struct replay_slot * tomb = NULL;
+
+	for (;; i = (i + 1) & replay_mask) {
+		struct replay_slot * s = &replay_map[i];
+		if (s->addr == addr)
+			return s;
+		if (s->addr == 1 && !tomb)
+			tomb = s;
+		if (!s->addr) {
+			if (!insert)
+				return NULL;
+			return tomb ? tomb : s;
+		}
+	}
+}
+
+// the id a block had when it was released, REPLAY_NONE if the trace
+// never saw it allocated
+static uint32_t
+replay_release(uint64_t addr)
+{
+	struct replay_slot * s = replay_find(addr, 0);
+	if (!s)
+		return REPLAY_NONE;
+	s->addr = 1;
+	return s->id;
+}
+
+static void
+replay_obtain(size_t i)
+{
+	struct replay_slot * s = replay_find(replay.ev[i].ptr, 1);
+	s->addr = replay.ev[i].ptr;
+	s->id = replay.id[i] = replay.ids++;
+}
+
+static int
+replay_by_seq(const void * a, const void * b)
+{
+	const struct mo_trace_event * x = a, * y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int
+replay_by_seq0(const void * a, const void * b)
+{
+	const struct mo_trace_event * x = &replay.ev[*(const size_t *)a];
+	const struct mo_trace_event * y = &replay.ev[*(const size_t *)b];
+	return x->seq0 < y->seq0 ? -1 : x->seq0 > y->seq0;
+}
+
+static int
+replay_by_tid(const void * a, const void * b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// frees, moving reallocs and realloc(p, 0) release a block
+static int
+replay_releases(const struct mo_trace_event * e)
+{
+	return (e->op == MO_TRACE_FREE && e->ptr) ||
+		(e->op == MO_TRACE_REALLOC && e->arg && (e->ptr || !e->size));
+}
+
+static int
+replay_obtains(const struct mo_trace_event * e)
+{
+	return e->op != MO_TRACE_FREE && e->ptr;
+}
+
+// give every block an id. the blocks are released in seq0 order and
+// obtained in seq order, a realloc that moves does both: walk the two
+// orders merged.
+static void
+replay_assign_ids(void)
+{
+	size_t i, j, nrel = 0, * rel;
+
+	replay.id = replay_alloc(replay.n * sizeof(uint32_t));
+	replay.old = replay_alloc(replay.n * sizeof(uint32_t));
+	memset(replay.id, 0xff, replay.n * sizeof(uint32_t));
+	memset(replay.old, 0xff, replay.n * sizeof(uint32_t));
+	for (replay_mask = 1; replay_mask < 2 * replay.n; replay_mask <<= 1)
+		;
+	replay_map = replay_alloc(replay_mask * sizeof(struct replay_slot));
+	replay_mask--;
+
+	rel = replay_alloc(replay.n * sizeof(size_t));
+	for (i=0; i<replay.n; i++) {
+		if (replay_releases(&replay.ev[i]))
+			rel[nrel++] = i;
+	}
+	qsort(rel, nrel, sizeof(size_t), replay_by_seq0);
+
+	for (i=0, j=0; i<replay.n || j<nrel; ) {
+		if (j < nrel && (i == replay.n || replay.ev[rel[j]].seq0 < replay.ev[i].seq)) {
+			const struct mo_trace_event * e = &replay.ev[rel[j]];
+			uint32_t id = replay_release(e->op == MO_TRACE_FREE ? e->ptr : e->arg);
+			replay.old[rel[j]] = id;
+			if (id == REPLAY_NONE)
+				replay.skipped++;
+			j++;
+		} else {
+			if (replay_obtains(&replay.ev[i]))
+				replay_obtain(i);
+			i++;
+		}
+	}
+	munmap(rel, replay.n * sizeof(size_t));
+	munmap(replay_map, (replay_mask + 1) * sizeof(struct replay_slot));
+
+	replay.ptrs = replay_alloc((replay.ids + 1) * sizeof(void *));
+	for (i=0; i<replay.ids; i++)
+		replay.ptrs[i] = REPLAY_PENDING;
+}
+
+// one replay thread per traced thread, each with its events in order
+static void
+replay_split_threads(void)
+{
+	uint32_t * tids = replay_alloc(replay.n * sizeof(uint32_t));
+	size_t i, k, * rank;
+	unsigned t;
+
+	for (i=0; i<replay.n; i++)
+		tids[i] = replay.ev[i].tid;
+	qsort(tids, replay.n, sizeof(uint32_t), replay_by_tid);
+	for (i=0, k=0; i<replay.n; i++) {
+		if (!i || tids[i] != tids[k - 1])
+			tids[k++] = tids[i];
+	}
+	replay.nthreads = k;
+	replay.threads = calloc(k, sizeof(struct replay_thread));
+	rank = replay_alloc(replay.n * sizeof(size_t));
+	assert(replay.threads);
+
+	for (i=0; i<replay.n; i++) {
+		uint32_t * p = bsearch(&replay.ev[i].tid, tids, k, sizeof(uint32_t), replay_by_tid);
+		replay.threads[p - tids].count++;
+	}
+	for (t=0, k=0; t<replay.nthreads; t++) {
+		replay.threads[t].tid = tids[t];
+		replay.threads[t].rank = rank + k;
+		k += replay.threads[t].count;
+		replay.threads[t].count = 0;
+	}
+	for (i=0; i<replay.n; i++) {
+		uint32_t * p = bsearch(&replay.ev[i].tid, tids, replay.nthreads,
+							   sizeof(uint32_t), replay_by_tid);
+		struct replay_thread * th = &replay.threads[p - tids];
+		th->rank[th->count++] = i;
+	}
+	munmap(tids, replay.n * sizeof(uint32_t));
+}
+
+static void
+replay_wait(size_t i)
+{
+	unsigned spins = 0;
+	while (__atomic_load_n(&replay.turn, __ATOMIC_ACQUIRE) != i) {
+		if (++spins > REPLAY_SPIN)
+			sched_yield();
+	}
+}
+
+// a block freed by another thread may not be there yet
+static void *
+replay_get(uint32_t id)
+{
+	unsigned spins = 0;
+	void * p;
+
+	if (id == REPLAY_NONE)
+		return NULL;
+	while ((p = __atomic_load_n(&replay.ptrs[id], __ATOMIC_ACQUIRE)) == REPLAY_PENDING) {
+		if (++spins > REPLAY_SPIN)
+			sched_yield();
+	}
+	return p;
+}
+
+static void
+replay_event(size_t i)
+{
+	const struct mo_trace_event * e = &replay.ev[i];
+	void * p = NULL, * old;
+
+	switch (e->op) {
+	case MO_TRACE_MALLOC:
+		if (e->ptr)
+			p = malloc(e->size);
+		break;
+	case MO_TRACE_CALLOC:
+		if (e->ptr)
+			p = calloc(1, e->size);
+		break;
+	case MO_TRACE_MEMALIGN:
+		if (e->ptr && posix_memalign(&p, e->arg < sizeof(void *) ? sizeof(void *) : e->arg,
+									 e->size))
+			p = NULL;
+		break;
+	case MO_TRACE_REALLOC:
+		if (!e->ptr && e->size)
+			break;				// failed, the old block is still there
+		old = replay_get(replay.old[i]);
+		if (!e->size) {
+			free(old);
+			break;
+		}
+		p = realloc(old, e->size);
+		break;
+	case MO_TRACE_FREE:
+		if (replay.old[i] != REPLAY_NONE)
+			free(replay_get(replay.old[i]));
+		break;
+	}
+	if (replay.id[i] != REPLAY_NONE) {
+		// touch it, as the traced program must have
+		if (p)
+			*(volatile char *)p = 0;
+		__atomic_store_n(&replay.ptrs[replay.id[i]], p, __ATOMIC_RELEASE);
+	}
+}
+
+static void *
+replay_thread(void * arg)
+{
+	struct replay_thread * t = arg;
+	size_t k, i;
+
+	for (k=0; k<t->count; k++) {
+		i = t->rank[k];
+		if (!replay.fast)
+			replay_wait(i);
+		replay_event(i);
+		if (!replay.fast)
+			__atomic_store_n(&replay.turn, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+// syscalls made by libmozart so far, -1 when it is not loaded
+static long
+replay_syscalls(void)
+{
+	void (*stats)(struct mo_stats *) = (void (*)(struct mo_stats *))dlsym(RTLD_DEFAULT, "mo_stats");
+	struct mo_stats st;
+
+	if (!stats)
+		return -1;
+	stats(&st);
+	return st.mmap + st.mprotect + st.munmap + st.madvise + st.mremap;
+}
+
+static int
+replay_load(const char * path)
+{
+	struct mo_trace_header * h;
+	struct stat st;
+	char * map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		fprintf(stderr, "replay: %s: not a trace\n", path);
+		return -1;
+	}
+	// private: the events are sorted in place
+	map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	h = (struct mo_trace_header *)map;
+	if (memcmp(h->magic, MO_TRACE_MAGIC, sizeof(h->magic)) ||
+		h->version != MO_TRACE_VERSION || h->event_size != sizeof(struct mo_trace_event)) {
+		fprintf(stderr, "replay: %s: not a version %d trace\n", path, MO_TRACE_VERSION);
+		return -1;
+	}
+	replay.ev = (struct mo_trace_event *)(map + sizeof(*h));
+	// a trace cut short ends in part of an event
+	replay.n = (st.st_size - sizeof(*h)) / sizeof(struct mo_trace_event);
+	qsort(replay.ev, replay.n, sizeof(struct mo_trace_event), replay_by_seq);
+	return 0;
+}
+
+static void
+replay_usage(void)
+{
+	fprintf(stderr, "usage: replay [-l lib] [-f] trace\n"
+			"  -l  preload lib, ./libmozart.so say\n"
+			"  -f  fast, only wait for blocks to exist, not for the trace order\n");
+	exit(2);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * lib = NULL;
+	struct timespec t0, t1;
+	struct rusage ru;
+	unsigned t;
+	int c, rc;
+
+	while ((c = getopt(argc, argv, "l:f")) != -1) {
+		switch (c) {
+		case 'l': lib = optarg; break;
+		case 'f': replay.fast = 1; break;
+		default:  replay_usage();
+		}
+	}
+	if (optind != argc - 1)
+		replay_usage();
+
+	// again, with lib preloaded
+	if (lib) {
+		char path[PATH_MAX];
+		if (!realpath(lib, path)) {
+			fprintf(stderr, "replay: %s: %s\n", lib, strerror(errno));
+			return 1;
+		}
+		char * args[4] = { argv[0] };
+		int k = 1;
+		if (replay.fast)
+			args[k++] = "-f";
+		args[k++] = argv[optind];
+		args[k] = NULL;
+		setenv("LD_PRELOAD", path, 1);
+		execv("/proc/self/exe", args);
+		perror("replay: exec");
+		return 1;
+	}
+
+	if (replay_load(argv[optind]))
+		return 1;
+	if (!replay.n) {
+		fprintf(stderr, "replay: %s: no events\n", argv[optind]);
+		return 1;
+	}
+	replay_assign_ids();
+	replay_split_threads();
+	printf("replay: %zu events, %u threads, %u blocks, %zu frees of unknown blocks\n",
+		   replay.n, replay.nthreads, replay.ids, replay.skipped);
+	// the trace and the tables are in there already
+	getrusage(RUSAGE_SELF, &ru);
+	long rss0 = ru.ru_maxrss;
+
+	long sys = replay_syscalls();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (t=0; t<replay.nthreads; t++) {
+		rc = pthread_create(&replay.threads[t].th, NULL, replay_thread, &replay.threads[t]);
+		assert(rc == 0);
+	}
+	for (t=0; t<replay.nthreads; t++)
+		pthread_join(replay.threads[t].th, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &ru);
+
+	double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("replay: %s, %s: %.3f s, %.0f calls/sec, %ld KiB peak rss, %ld KiB of it by the replay",
+		   sys >= 0 ? "mozart" : "glibc", replay.fast ? "fast" : "in order",
+		   sec, replay.n / sec, ru.ru_maxrss, ru.ru_maxrss - rss0);
+	if (sys >= 0)
+		printf(", %ld syscalls", replay_syscalls() - sys);
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# symbolize a MO_STACKS_DUMP file offline: every frame is looked up in
+# the maps copy of the dump, then handed to addr2line.
+#   sh stacks.sh dump [id ...]
+[ -f "$1" ] || { echo "usage: stacks.sh dump [id ...]" >&2; exit 2; }
+dump=$1
+shift
+
+# addresses as 16 hex digits compare as strings, any awk does
+awk -v ids=" $* " '
+function pad(h) {
+	sub(/^0x/, "", h)
+	while (length(h) < 16)
+		h = "0" h
+	return h
+}
+/^maps$/   { part = "maps"; next }
+/^stacks$/ { part = "stacks"; next }
+part == "maps" && $6 ~ /^\// {
+	split($1, r, "-")
+	n++
+	lo[n] = pad(r[1]); hi[n] = pad(r[2]); path[n] = $6
+	# the object is loaded at the start of its offset 0 mapping
+	if ($3 ~ /^0+$/ && !(path[n] in base))
+		base[path[n]] = lo[n]
+}
+part == "stacks" {
+	if (ids != "  " && index(ids, " " $1 " ") == 0)
+		next
+	for (i = 2; i <= NF; i++) {
+		pc = pad($i)
+		for (k = 1; k <= n; k++)
+			if (pc >= lo[k] && pc < hi[k])
+				break
+		if (k <= n)
+			print $1, i - 2, path[k], $i, "0x" base[path[k]]
+		else
+			print $1, i - 2, "?", $i, 0
+	}
+}' "$dump" | while read id frame obj pc base; do
+	[ "$frame" = 0 ] && echo "stack $id:"
+	if [ "$obj" = "?" ]; then
+		echo "  #$frame $pc"
+		continue
+	fi
+	# a return address is past the call, look the call up. a non-PIE
+	# executable is linked at its load address.
+	addr=$(( pc - 1 ))
+	case $(readelf -h "$obj" 2>/dev/null | awk '/Type:/ { print $2 }') in
+	EXEC) ;;
+	*)    addr=$(( addr - base ));;
+	esac
+	addr=$(printf "0x%x" "$addr")
+	echo "  #$frame $(addr2line -f -C -p -e "$obj" "$addr" 2>/dev/null || echo "$obj+$addr")"
+done
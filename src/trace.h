@@ -0,0 +1,46 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+// MO_TRACE=<file> writes a header, then fixed size events in no
+// particular order: every thread's ring is flushed on its own. sort
+// them by seq to get the order the calls were made in, see replay.c.
+#define MO_TRACE_MAGIC		"MOTRACE1"
+#define MO_TRACE_VERSION	1
+
+enum {
+	MO_TRACE_MALLOC = 1,
+	MO_TRACE_CALLOC,
+	MO_TRACE_MEMALIGN,		// posix_memalign, aligned_alloc, valloc, ...
+	MO_TRACE_REALLOC,
+	MO_TRACE_FREE,
+};
+
+struct mo_trace_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t event_size;		// sizeof(struct mo_trace_event)
+	uint64_t time0;				// CLOCK_REALTIME at start, ns
+	uint64_t pid;
+	uint64_t reserved[4];
+};
+
+// seq is taken before the block is released by a free and after the
+// call returns for everything else, so a block is always freed before
+// it shows up again. a realloc releases the old block at seq0 and
+// obtains the new one at seq, seq0 is seq for the others.
+// a failed call has a ptr of 0.
+struct mo_trace_event {
+	uint64_t seq;
+	uint64_t seq0;
+	uint64_t time;		// ns since the start of the trace
+	uint64_t ptr;		// returned, or freed
+	uint64_t arg;		// realloc: the old block, memalign: the alignment
+	uint64_t size;		// calloc: the product
+	uint64_t caller;	// return address
+	uint32_t tid;
+	uint32_t op;
+};
+
+#endif